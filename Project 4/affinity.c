@@ -0,0 +1,131 @@
+// pthread_setaffinity_np, CPU_SET
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "affinity.h"
+
+typedef struct cpu_info {
+  int cpu;
+  int package;
+  int core;
+  int sibling;  // Index among the hardware threads of its core
+} cpu_info_t;
+
+// Reads a number from /sys/devices/system/cpu/cpu<cpu>/topology/<name>, or
+// returns fallback.
+static int read_topology(int cpu, const char* name, int fallback)
+{
+  char path[128];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE* f = fopen(path, "r");
+  if (f == NULL)
+  {
+    return fallback;
+  }
+  int value;
+  if (fscanf(f, "%d", &value) != 1)
+  {
+    value = fallback;
+  }
+  fclose(f);
+  return value;
+}
+
+static int compare_cpus(const void* a, const void* b)
+{
+  const cpu_info_t* x = (const cpu_info_t*)a;
+  const cpu_info_t* y = (const cpu_info_t*)b;
+  if (x->sibling != y->sibling)
+  {
+    return x->sibling - y->sibling;
+  }
+  if (x->package != y->package)
+  {
+    return x->package - y->package;
+  }
+  if (x->core != y->core)
+  {
+    return x->core - y->core;
+  }
+  return x->cpu - y->cpu;
+}
+
+affinity_t* make_affinity()
+{
+  affinity_t* a = (affinity_t*)malloc(sizeof(affinity_t));
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+  {
+    CPU_ZERO(&allowed);
+    CPU_SET(0, &allowed);
+  }
+  a->num_cpus = CPU_COUNT(&allowed);
+  a->order    = (int*)malloc(sizeof(int) * a->num_cpus);
+
+  cpu_info_t* cpus = (cpu_info_t*)malloc(sizeof(cpu_info_t) * a->num_cpus);
+  int n = 0;
+  for (int cpu = 0; n < a->num_cpus; cpu++)
+  {
+    if (!CPU_ISSET(cpu, &allowed))
+    {
+      continue;
+    }
+    cpus[n].cpu     = cpu;
+    cpus[n].package = read_topology(cpu, "physical_package_id", 0);
+    cpus[n].core    = read_topology(cpu, "core_id", cpu);
+    cpus[n].sibling = 0;
+    for (int i = 0; i < n; i++)
+    {
+      if (cpus[i].package == cpus[n].package && cpus[i].core == cpus[n].core)
+      {
+        cpus[n].sibling++;
+      }
+    }
+    n++;
+  }
+  qsort(cpus, n, sizeof(cpu_info_t), compare_cpus);
+
+  // The first hardware threads of the cores lead the order, package by package.
+  a->num_cores         = 0;
+  a->num_packages      = 0;
+  a->cores_per_package = 0;
+  for (int i = 0; i < n; i++)
+  {
+    a->order[i] = cpus[i].cpu;
+    if (cpus[i].sibling == 0)
+    {
+      a->num_cores++;
+      a->num_packages      += (i == 0 || cpus[i].package != cpus[i - 1].package);
+      a->cores_per_package += (cpus[i].package == cpus[0].package);
+    }
+  }
+
+  free(cpus);
+  return a;
+}
+
+void free_affinity(affinity_t* a)
+{
+  free(a->order);
+  free(a);
+}
+
+void affinity_pin_team(affinity_t* a, int threads)
+{
+  omp_set_num_threads(threads);
+  #pragma omp parallel
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(a->order[omp_get_thread_num() % a->num_cpus], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+// CPU topology and thread pinning, for the workers of a net_context and for
+// reproducible scaling runs. The CPUs the process may run on are ordered one
+// hardware thread per physical core first, package by package, and the SMT
+// siblings after them, so that the first t CPUs of the order are the t a
+// team of t threads should use: each thread gets a core of its own for as
+// long as there are cores, and the threads fill one package before the next.
+
+typedef struct affinity {
+  int num_cpus;           // CPUs the process may run on
+  int num_cores;          // Physical cores among them
+  int num_packages;
+  int cores_per_package;  // Cores of the first package
+  int* order;             // num_cpus CPU numbers in pinning order
+} affinity_t;
+
+// Reads the topology of the CPUs in the process's affinity mask from sysfs.
+// Where that is not available, takes every CPU for a core of its own in a
+// single package.
+affinity_t* make_affinity();
+
+void free_affinity(affinity_t* a);
+
+// Pins thread i of an OpenMP team of threads threads (the calling thread is
+// thread 0) to order[i], wrapping around past num_cpus. Later parallel
+// regions with the same number of threads run on the same pinned threads.
+void affinity_pin_team(affinity_t* a, int threads);
+
+#endif
@@ -1,17 +1,56 @@
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
+#include "cifar.h"
 #include "network.h"
+#ifndef BASELINE
+#include "affinity.h"
+#include "context.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "quant.h"
+#include "roofline.h"
+#include "snapshot.h"
+#endif
 #include "volume.h"
 
 // Place where test data is stored on instructional machines.
 const char* DATA_FOLDER = "/home/ff/cs61c/proj4/cifar-10-batches-bin";
 const int DEFAULT_BENCHMARK_SIZE = 1200;
 const int PARTEST_SIZE = 1000;
+const int CALIBRATION_SIZE = 500;
+const int SERVE_GROUP_SIZE = 16;
+const int PROFILE_WARMUP_SIZE = 64;
+
+// Defaults of "harness": images per batch, warmup and measured batches.
+const int HARNESS_BATCH = 64;
+const int HARNESS_WARMUP = 3;
+const int HARNESS_ITERATIONS = 20;
+
+// Batch sizes "scale" runs net_classify with, and timed runs per point.
+const int SCALE_BATCHES[] = {1, 2, 4, 8, 16, 32};
+const int SCALE_RUNS = 3;
+
+// Binary snapshot written by "convert", preferred over the text files.
+const char* SNAPSHOT_FILE = "./snapshot/cnn.bin";
+
+#ifndef BASELINE
+// Calibrated int8 scales of l0, l3, l6 and l9, written by "calibrate".
+const char* QUANT_FILES[4] = {"./snapshot/layer1_conv_q8.txt", "./snapshot/layer4_conv_q8.txt",
+                              "./snapshot/layer7_conv_q8.txt", "./snapshot/layer10_fc_q8.txt"};
+
+// Whether load_cnn_snapshot attaches the int8 weights to the network.
+int use_int8 = 0;
+#endif
 
 // Function to dump the content of a volume for comparison.
 void dump_volume(volume_t* v) {
@@ -26,77 +65,52 @@ void dump_volume(volume_t* v) {
   printf("\n");
 }
 
-// Load the snapshot of the CNN we are going to run.
-network_t* load_cnn_snapshot() {
-  network_t* net = make_network();
+// Parse the text snapshot of the CNN into its layers.
+void load_cnn_text(network_t* net) {
   conv_load(net->l0, "./snapshot/layer1_conv.txt");
   conv_load(net->l3, "./snapshot/layer4_conv.txt");
   conv_load(net->l6, "./snapshot/layer7_conv.txt");
   fc_load(net->l9, "./snapshot/layer10_fc.txt");
-  return net;
 }
 
-// Load an image from the cifar10 data set.
-void load_sample(volume_t* v, int sample_num) {
-  printf("Loading input sample %d...\n", sample_num);
-
-  int batch = sample_num / 10000;
-  int ix    = sample_num % 10000;
-
-  char file_name[1024];
-  sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch + 1);
-
-  FILE* fin = fopen(file_name, "rb");
-  assert(fin != NULL);
-
-  fseek(fin, ix * 3073, SEEK_SET);
-
-  uint8_t data[3073];
-  assert(fread(data, 1, 3073, fin) == 3073);
+// Load the snapshot of the CNN we are going to run: map the binary snapshot
+// if there is a usable one, parse the text files otherwise.
+network_t* load_cnn_snapshot() {
+  network_t* net = make_network();
+#ifdef BASELINE
+  load_cnn_text(net);
+#else
+  if (!snapshot_map(net, SNAPSHOT_FILE)) {
+    load_cnn_text(net);
+  }
 
-  int outp = 1;
-  for (int d = 0; d < 3; d++) {
-    for (int y = 0; y < 32; y++) {
-      for (int x = 0; x < 32; x++) {
-        volume_set(v, x, y, d, ((double)data[outp++]) / 255.0 - 0.5);
-      }
+  if (use_int8) {
+    net->l0->quant = quant_load(net->l0->filters, net->l0->output_depth, QUANT_FILES[0]);
+    net->l3->quant = quant_load(net->l3->filters, net->l3->output_depth, QUANT_FILES[1]);
+    net->l6->quant = quant_load(net->l6->filters, net->l6->output_depth, QUANT_FILES[2]);
+    net->l9->quant = quant_load(net->l9->filters, net->l9->output_depth, QUANT_FILES[3]);
+    if (!net->l0->quant || !net->l3->quant || !net->l6->quant || !net->l9->quant) {
+      printf("ERROR: Missing int8 calibration, run ./benchmark calibrate first\n");
+      exit(2);
     }
   }
-
-  fclose(fin);
+#endif
+  return net;
 }
 
-// Load an entire batch of images from the cifar10 data set (which is divided
-// into 5 batches with 10,000 images each).
-batch_t load_batch(int batch) {
-  printf("Loading input batch %d...\n", batch);
-
-  char file_name[1024];
-  sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, batch + 1);
-
-  FILE* fin = fopen(file_name, "rb");
-  assert(fin != NULL);
-  batch_t batchdata = malloc(sizeof(volume_t*) * 10000);
-
-  for (int i = 0; i < 10000; i++) {
-    batchdata[i] = make_volume(32, 32, 3, 0.0);
-
-    uint8_t data[3073];
-    assert(fread(data, 1, 3073, fin) == 3073);
-
-    int outp = 1;
-    for (int d = 0; d < 3; d++) {
-      for (int y = 0; y < 32; y++) {
-        for (int x = 0; x < 32; x++) {
-          volume_set(batchdata[i], x, y, d, ((double)data[outp++]) / 255.0 - 0.5);
-        }
-      }
-    }
+// The cifar10 data set, mapped on first use.
+cifar_t* dataset() {
+  static cifar_t* data = NULL;
+  if (data == NULL) {
+    data = cifar_open(DATA_FOLDER);
   }
+  return data;
+}
 
-  fclose(fin);
-
-  return batchdata;
+// Load an image from the cifar10 data set.
+void load_sample(volume_t* v, int sample_num) {
+  printf("Loading input sample %d...\n", sample_num);
+  cifar_decode(dataset(), sample_num, v);
 }
 
 // Computes the accuracy of our neural network by comparing our predicted values
@@ -104,91 +118,79 @@ batch_t load_batch(int batch) {
 double get_accuracy(int* samples, int* predictions, int n) {
   int num_correct = 0;
 
-  char file_name[1024];
-
-  // Open all data batch files.
-  FILE* batch_files[5];
-  for (int i = 0; i < 5; i++) {
-    sprintf(file_name, "%s/data_batch_%d.bin", DATA_FOLDER, i + 1);
-    batch_files[i] = fopen(file_name, "rb");
-  }
-
   for (int i = 0; i < n; i++) {
-    int batch = samples[i] / 10000;
-    int index = samples[i] % 10000;
-    fseek(batch_files[batch], index * 3073, SEEK_SET);
-    char label;
-    fread(&label, 1, 1, batch_files[batch]);
-    if (label == predictions[i]) {
+    if (cifar_label(dataset(), samples[i]) == predictions[i]) {
       num_correct += 1;
     }
   }
 
-  // Close all data batch files.
-  for (int i = 0; i < 5; i++) {
-    fclose(batch_files[i]);
+  return ((double)num_correct) / n;
+}
+
+// Picks the most likely class of each of the n images.
+void get_predictions(double** likelihoods, int* predictions, int n) {
+  for (int i = 0; i < n; i++) {
+    int best_class        = -1;
+    double max_likelihood = -INFINITY;
+    for (int c = 0; c < NUM_CLASSES; c++) {
+      if (max_likelihood < likelihoods[i][c]) {
+        max_likelihood = likelihoods[i][c];
+        best_class     = c;
+      }
+    }
+    predictions[i] = best_class;
   }
+}
 
-  return ((double)num_correct) / n;
+#ifndef BASELINE
+// Input callback of the classification: image i is sample samples[i].
+void decode_sample(void* samples, int i, volume_t* v) {
+  cifar_decode(dataset(), ((int*)samples)[i], v);
+}
+
+// Output callback of the classification: keeps the likelihoods of image i.
+void store_likelihoods(void* likelihoods, int i, const double* values) {
+  memcpy(((double**)likelihoods)[i], values, sizeof(double) * NUM_CLASSES);
 }
+#endif
 
 // Perform the classification (this calls into the functions from network.c)
 void run_classification(int* samples, int n, double*** keep_likelihoods) {
   printf("Making network...\n");
   network_t* net = load_cnn_snapshot();
 
-  batch_t batches[50];
-  for (int i = 0; i < 50; i++) {
-    batches[i] = NULL;
-  }
-
-  printf("Loading batches...\n");
-  for (int i = 0; i < n; i++) {
-    int batch = samples[i] / 10000;
-    if (batches[batch] == NULL) {
-      batches[batch] = load_batch(batch);
-    }
-  }
-
-  volume_t** input = (volume_t**)malloc(sizeof(volume_t*) * n);
-  for (int i = 0; i < n; i++) {
-    input[i] = batches[samples[i] / 10000][samples[i] % 10000];
-  }
-
   double** likelihoods = (double**)malloc(sizeof(double*) * n);
   for (int c = 0; c < n; c++) {
     likelihoods[c] = (double*)malloc(sizeof(double) * NUM_CLASSES);
   }
 
   printf("Running classification...\n");
+#ifdef BASELINE
+  // The baseline network only takes decoded volumes.
+  volume_t** input = (volume_t**)malloc(sizeof(volume_t*) * n);
+  for (int i = 0; i < n; i++) {
+    input[i] = make_volume(CIFAR_WIDTH, CIFAR_HEIGHT, CIFAR_DEPTH, 0.0);
+    cifar_decode(dataset(), samples[i], input[i]);
+  }
   net_classify(net, input, likelihoods, n);
-
-  int predictions[n];
   for (int i = 0; i < n; i++) {
-    int best_class        = -1;
-    double max_likelihood = -INFINITY;
-    for (int c = 0; c < NUM_CLASSES; c++) {
-      if (max_likelihood < likelihoods[i][c]) {
-        max_likelihood = likelihoods[i][c];
-        best_class     = c;
-      }
-    }
-    predictions[i] = best_class;
+    free_volume(input[i]);
   }
+  free(input);
+#else
+  // Decoding streams alongside the classification (see pipeline.h), which runs
+  // mini-batches of NET_BATCH images like net_classify. The data set is mapped
+  // here so that the decoder threads only ever read it.
+  dataset();
+  net_classify_stream(net, decode_sample, samples, store_likelihoods, likelihoods, n, NULL);
+#endif
+
+  int predictions[n];
+  get_predictions(likelihoods, predictions, n);
 
   printf("%lf%% accuracy\n", 100 * get_accuracy(samples, predictions, n));
 
   free_network(net);
-  free(input);
-
-  for (int i = 0; i < 50; i++) {
-    if (batches[i] != NULL) {
-      for (int j = 0; j < 10000; j++) {
-        free_volume(batches[i][j]);
-      }
-      free(batches[i]);
-    }
-  }
 
   if (keep_likelihoods == NULL) {
     for (int i = 0; i < n; i++) {
@@ -230,6 +232,98 @@ void do_benchmark(int argc, char** argv) {
   free(samples);
 }
 
+// Reads the monotonic clock, in microseconds.
+double monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile p of n sorted values.
+double percentile(const double* sorted, int n, double p) {
+  int rank = (int)ceil(p / 100 * n);
+  return sorted[(rank < 1) ? 0 : rank - 1];
+}
+
+// Steady-state benchmark: builds the network and decodes one batch of images
+// (timed apart as setup), classifies the batch warmup times untimed, then
+// iterations times, each timed on its own. Prints throughput and statistics
+// of the per-batch latency, then every latency as a LATENCY line, which
+// test/compare_bench.py reads to compare two builds ("make compare").
+void do_harness(int argc, char** argv) {
+  int batch = (argc > 0) ? atoi(argv[0]) : HARNESS_BATCH;
+  int warmup = (argc > 1) ? atoi(argv[1]) : HARNESS_WARMUP;
+  int iterations = (argc > 2) ? atoi(argv[2]) : HARNESS_ITERATIONS;
+  if (batch < 1 || warmup < 0 || iterations < 1) {
+    printf("Usage: ./benchmark harness [batch] [warmup] [iterations]\n");
+    exit(2);
+  }
+
+  double setup_start = monotonic_us();
+  network_t* net = load_cnn_snapshot();
+  volume_t** input = (volume_t**)malloc(sizeof(volume_t*) * batch);
+  double** likelihoods = (double**)malloc(sizeof(double*) * batch);
+  for (int i = 0; i < batch; i++) {
+    input[i] = make_volume(CIFAR_WIDTH, CIFAR_HEIGHT, CIFAR_DEPTH, 0.0);
+    cifar_decode(dataset(), i, input[i]);
+    likelihoods[i] = (double*)malloc(sizeof(double) * NUM_CLASSES);
+  }
+  double setup = monotonic_us() - setup_start;
+
+  for (int k = 0; k < warmup; k++) {
+    net_classify(net, input, likelihoods, batch);
+  }
+  double* latency = (double*)malloc(sizeof(double) * iterations);
+  for (int k = 0; k < iterations; k++) {
+    double start = monotonic_us();
+    net_classify(net, input, likelihoods, batch);
+    latency[k] = monotonic_us() - start;
+  }
+
+  double sum = 0;
+  for (int k = 0; k < iterations; k++) {
+    sum += latency[k];
+  }
+  double mean = sum / iterations;
+  double var = 0;
+  for (int k = 0; k < iterations; k++) {
+    var += (latency[k] - mean) * (latency[k] - mean);
+  }
+  double stddev = (iterations > 1) ? sqrt(var / (iterations - 1)) : 0;
+
+  double sorted[iterations];
+  memcpy(sorted, latency, sizeof(double) * iterations);
+  qsort(sorted, iterations, sizeof(double), compare_doubles);
+  double median = (iterations % 2) ? sorted[iterations / 2]
+                                   : (sorted[iterations / 2 - 1] + sorted[iterations / 2]) / 2;
+
+  printf("HARNESS: %d images per batch, %d warmup, %d measured batches\n", batch, warmup, iterations);
+  printf("setup: %.0lf microseconds\n", setup);
+  printf("throughput: %.1lf images/s\n", batch / (mean / 1e6));
+  printf("latency per batch (microseconds): mean %.1lf, median %.1lf, p95 %.1lf, p99 %.1lf, min %.1lf, max %.1lf\n",
+         mean, median, percentile(sorted, iterations, 95), percentile(sorted, iterations, 99), sorted[0],
+         sorted[iterations - 1]);
+  printf("coefficient of variation: %.2lf%%\n", 100 * stddev / mean);
+  for (int k = 0; k < iterations; k++) {
+    printf("LATENCY%d,%.1lf\n", k, latency[k]);
+  }
+
+  for (int i = 0; i < batch; i++) {
+    free_volume(input[i]);
+    free(likelihoods[i]);
+  }
+  free(input);
+  free(likelihoods);
+  free(latency);
+  free_network(net);
+}
+
 // Run test of classifying individual samples and check the content of every layer
 // against reference output produced by convnet.js.
 void do_layers_test(int argc, char** argv) {
@@ -243,6 +337,8 @@ void do_layers_test(int argc, char** argv) {
 
   printf("Making network...\n");
   network_t* net = load_cnn_snapshot();
+  // Every layer is dumped, so none of them may be fused away.
+  net->fused = 0;
 
   batch_t* batch = make_batch(net, 1);
   load_sample(batch[0][0], sample_num);
@@ -288,9 +384,397 @@ void do_parallel_test(int argc, char** argv) {
   free(samples);
 }
 
+#ifndef BASELINE
+// Calibrate the int8 path: run the first images of the data set through the
+// network, record the range of the input of every conv and fc layer, and write
+// the resulting scales next to the snapshot.
+void do_calibrate(int argc, char** argv) {
+  int n = CALIBRATION_SIZE;
+  if (argc > 0) {
+    n = atoi(argv[0]);
+  }
+
+  assert(n > 0 && n <= CIFAR_BATCH_SIZE);
+
+  printf("Making network...\n");
+  network_t* net = load_cnn_snapshot();
+
+  const int layers[4] = {0, 3, 6, 9};
+  real_t lo[4] = {0.0, 0.0, 0.0, 0.0};
+  real_t hi[4] = {0.0, 0.0, 0.0, 0.0};
+
+  printf("Calibrating on %d images...\n", n);
+  const int chunk = 64;
+  batch_t* b = make_batch(net, chunk);
+  for (int i = 0; i < n; i += chunk) {
+    int m = (n - i < chunk) ? n - i : chunk;
+    for (int j = 0; j < m; j++) {
+      cifar_decode(dataset(), i + j, b[0][j]);
+    }
+    net_forward(net, b, 0, m - 1);
+
+    for (int l = 0; l < 4; l++) {
+      for (int j = 0; j < m; j++) {
+        volume_t* v = b[layers[l]][j];
+        for (int y = 0; y < v->height; y++) {
+          for (int x = 0; x < v->width; x++) {
+            for (int d = 0; d < v->depth; d++) {
+              real_t w = volume_get(v, x, y, d);
+              lo[l] = (w < lo[l]) ? w : lo[l];
+              hi[l] = (w > hi[l]) ? w : hi[l];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  quant_t* q[4] = {make_quant(net->l0->filters, net->l0->output_depth, lo[0], hi[0]),
+                   make_quant(net->l3->filters, net->l3->output_depth, lo[1], hi[1]),
+                   make_quant(net->l6->filters, net->l6->output_depth, lo[2], hi[2]),
+                   make_quant(net->l9->filters, net->l9->output_depth, lo[3], hi[3])};
+  for (int l = 0; l < 4; l++) {
+    printf("LAYER%d input range [%lf, %lf] -> %s\n", layers[l], (double)lo[l], (double)hi[l], QUANT_FILES[l]);
+    quant_save(q[l], QUANT_FILES[l]);
+    free_quant(q[l]);
+  }
+
+  free_batch(b, chunk);
+  free_network(net);
+}
+
+// Compare the top-1 accuracy of the int8 path with the full precision path on
+// the same samples.
+void do_quant_test(int argc, char** argv) {
+  int num_samples = DEFAULT_BENCHMARK_SIZE;
+  if (argc > 0) {
+    num_samples = atoi(argv[0]);
+  }
+
+  int* samples = (int*)malloc(sizeof(int) * num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i;
+  }
+
+  double** reference;
+  double** quantized;
+  run_classification(samples, num_samples, &reference);
+  use_int8 = 1;
+  run_classification(samples, num_samples, &quantized);
+  use_int8 = 0;
+
+  int* expected  = (int*)malloc(sizeof(int) * num_samples);
+  int* predicted = (int*)malloc(sizeof(int) * num_samples);
+  get_predictions(reference, expected, num_samples);
+  get_predictions(quantized, predicted, num_samples);
+
+  int agree = 0;
+  for (int i = 0; i < num_samples; i++) {
+    agree += (expected[i] == predicted[i]);
+  }
+
+  printf("%s top-1: %lf%%\n", (sizeof(real_t) == sizeof(double)) ? "double" : "float",
+         100 * get_accuracy(samples, expected, num_samples));
+  printf("int8 top-1: %lf%%\n", 100 * get_accuracy(samples, predicted, num_samples));
+  printf("int8 agrees with full precision on %lf%% of %d images\n", 100.0 * agree / num_samples, num_samples);
+
+  for (int i = 0; i < num_samples; i++) {
+    free(reference[i]);
+    free(quantized[i]);
+  }
+  free(reference);
+  free(quantized);
+  free(expected);
+  free(predicted);
+  free(samples);
+}
+
+// Convert the text snapshot into the binary one load_cnn_snapshot maps.
+void do_convert(int argc, char** argv) {
+  const char* file_name = (argc > 0) ? argv[0] : SNAPSHOT_FILE;
+
+  network_t* net = make_network();
+  load_cnn_text(net);
+  if (!snapshot_save(net, file_name)) {
+    printf("ERROR: Could not write %s\n", file_name);
+    exit(2);
+  }
+  printf("Wrote %s\n", file_name);
+  free_network(net);
+}
+
+// Classify the first N images in groups of G, the way a service handling one
+// request at a time would: once with a net_classify call per group, and once
+// through a persistent inference context (see context.h). Prints the mean
+// latency of a group for both.
+void do_serve(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : DEFAULT_BENCHMARK_SIZE;
+  int group = (argc > 1) ? atoi(argv[1]) : SERVE_GROUP_SIZE;
+  assert(num_samples > 0 && group > 0);
+
+  int* samples = (int*)malloc(sizeof(int) * num_samples);
+  double** likelihoods[2];
+  for (int k = 0; k < 2; k++) {
+    likelihoods[k] = (double**)malloc(sizeof(double*) * num_samples);
+    for (int i = 0; i < num_samples; i++) {
+      likelihoods[k][i] = (double*)malloc(sizeof(double) * NUM_CLASSES);
+    }
+  }
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i;
+  }
+
+  network_t* net = load_cnn_snapshot();
+  dataset();
+  int groups = (num_samples + group - 1) / group;
+  printf("SERVING %d PICTURES IN GROUPS OF %d...\n", num_samples, group);
+
+  struct timeval tv;
+  uint64_t elapsed[2];
+  net_context_t* ctx = NULL;
+  for (int k = 0; k < 2; k++) {
+    gettimeofday(&tv, NULL);
+    uint64_t start = 1000000L * tv.tv_sec + tv.tv_usec;
+    if (k == 1) {
+      ctx = make_net_context(net, 0);
+    }
+
+    for (int g = 0; g < num_samples; g += group) {
+      int n = (num_samples - g < group) ? num_samples - g : group;
+      if (k == 0) {
+        net_classify_fn(net, decode_sample, samples + g, likelihoods[0] + g, n);
+      } else {
+        net_context_classify(ctx, decode_sample, samples + g, likelihoods[1] + g, n);
+      }
+    }
+
+    gettimeofday(&tv, NULL);
+    elapsed[k] = 1000000L * tv.tv_sec + tv.tv_usec - start;
+  }
+
+  int workers = net_context_workers(ctx);
+  net_worker_stats_t stats[workers];
+  net_context_stats(ctx, stats);
+  free_net_context(ctx);
+
+  int mismatches = 0;
+  for (int i = 0; i < num_samples; i++) {
+    mismatches += memcmp(likelihoods[0][i], likelihoods[1][i], sizeof(double) * NUM_CLASSES) != 0;
+  }
+
+  printf("net_classify: %lf microseconds per group\n", (double)elapsed[0] / groups);
+  printf("context (including its start-up): %lf microseconds per group\n", (double)elapsed[1] / groups);
+  for (int t = 0; t < workers; t++) {
+    printf("worker %d: %ld tasks, %ld images, %ld steals in %ld attempts\n", t, stats[t].tasks, stats[t].images,
+           stats[t].steals, stats[t].attempts);
+  }
+  if (mismatches > 0) {
+    printf("ERROR: %d images classified differently\n", mismatches);
+  }
+
+  for (int k = 0; k < 2; k++) {
+    for (int i = 0; i < num_samples; i++) {
+      free(likelihoods[k][i]);
+    }
+    free(likelihoods[k]);
+  }
+  free(samples);
+  free_network(net);
+}
+
+// Classifies num_samples images with every stage of net_forward timed, and
+// with counters also counting hardware events (or saying on stderr why it
+// cannot). A short untimed run first loads the weights and the code into the
+// caches. Returns the profile and sets wall to the time of the timed run.
+net_profile_t* profile_classify(network_t* net, int num_samples, int counters, uint64_t* wall) {
+  int* samples = (int*)malloc(sizeof(int) * num_samples);
+  double** likelihoods = (double**)malloc(sizeof(double*) * num_samples);
+  for (int i = 0; i < num_samples; i++) {
+    samples[i] = i;
+    likelihoods[i] = (double*)malloc(sizeof(double) * NUM_CLASSES);
+  }
+
+  dataset();
+  int warmup = (num_samples < PROFILE_WARMUP_SIZE) ? num_samples : PROFILE_WARMUP_SIZE;
+  net_classify_fn(net, decode_sample, samples, likelihoods, warmup);
+
+  net_profile_t* profile = make_net_profile(net);
+  if (counters && profile_enable_counters(profile) == 0) {
+    fprintf(stderr, "Hardware counters unavailable (%s), timing only\n", strerror(errno));
+  }
+  net->profile = profile;
+  uint64_t start = profile_start(profile);
+  net_classify_fn(net, decode_sample, samples, likelihoods, num_samples);
+  *wall = profile_start(profile) - start;
+  net->profile = NULL;
+
+  for (int i = 0; i < num_samples; i++) {
+    free(likelihoods[i]);
+  }
+  free(likelihoods);
+  free(samples);
+  return profile;
+}
+
+// Profiles num_samples images (DEFAULT_BENCHMARK_SIZE if not given), see
+// profile.h, and prints the time, GFLOP/s and GB/s of each stage as CSV, or
+// as JSON with "json". With "counters", also hardware events per stage.
+void do_profile(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : DEFAULT_BENCHMARK_SIZE;
+  int json = (argc > 1) && !strcmp(argv[1], "json");
+  int counters = (argc > 2) && !strcmp(argv[2], "counters");
+  if (num_samples < 1 || (argc > 1 && !json && strcmp(argv[1], "csv")) || (argc > 2 && !counters)) {
+    printf("Usage: ./benchmark profile [N] [csv|json] [counters]\n");
+    exit(2);
+  }
+
+  network_t* net = load_cnn_snapshot();
+  uint64_t wall;
+  net_profile_t* profile = profile_classify(net, num_samples, counters, &wall);
+  profile_write(profile, stdout, json, wall);
+
+  free_net_profile(profile);
+  free_network(net);
+}
+
+// Measures the peak compute rate and memory bandwidth of this machine, then
+// profiles num_samples images (DEFAULT_BENCHMARK_SIZE if not given) and
+// places each stage on the roofline (see roofline.h), as CSV or JSON.
+void do_roofline(int argc, char** argv) {
+  int num_samples = (argc > 0) ? atoi(argv[0]) : DEFAULT_BENCHMARK_SIZE;
+  int json = (argc > 1) && !strcmp(argv[1], "json");
+  if (num_samples < 1 || (argc > 1 && !json && strcmp(argv[1], "csv"))) {
+    printf("Usage: ./benchmark roofline [N] [csv|json]\n");
+    exit(2);
+  }
+
+  roofline_t roofline;
+  roofline_measure(&roofline);
+
+  network_t* net = load_cnn_snapshot();
+  uint64_t wall;
+  net_profile_t* profile = profile_classify(net, num_samples, 0, &wall);
+  roofline_write(&roofline, profile, stdout, json);
+
+  free_net_profile(profile);
+  free_network(net);
+}
+
+// Thread counts of "scale", increasing: the powers of two up to max_threads,
+// the cores of one package, all cores and max_threads. Returns their number.
+int scale_thread_counts(affinity_t* a, int max_threads, int* counts) {
+  int n = 0;
+  for (int t = 1; t <= max_threads; t *= 2) {
+    counts[n++] = t;
+  }
+  int boundaries[3] = {a->cores_per_package, a->num_cores, max_threads};
+  for (int k = 0; k < 3; k++) {
+    int t = boundaries[k];
+    int i = n;
+    while (i > 0 && counts[i - 1] > t) {
+      i--;
+    }
+    if (t > max_threads || (i > 0 && counts[i - 1] == t)) {
+      continue;
+    }
+    memmove(counts + i + 1, counts + i, sizeof(int) * (n - i));
+    counts[i] = t;
+    n++;
+  }
+  return n;
+}
+
+// Sweeps net_classify over thread counts up to max_threads (every CPU the
+// process may run on if not given) and the batch sizes of SCALE_BATCHES,
+// with each thread pinned to a core of its own while there are cores (see
+// affinity.h). Each point classifies at least 4 batches per thread, best of
+// SCALE_RUNS, and reports throughput, speedup and parallel efficiency over
+// 1 thread with the same batch size, as CSV or as JSON with "json".
+void do_scale(int argc, char** argv) {
+  affinity_t* a = make_affinity();
+  int max_threads = (argc > 0) ? atoi(argv[0]) : a->num_cpus;
+  int json = (argc > 1) && !strcmp(argv[1], "json");
+  if (max_threads < 1 || (argc > 1 && !json && strcmp(argv[1], "csv"))) {
+    printf("Usage: ./benchmark scale [max threads] [csv|json]\n");
+    exit(2);
+  }
+
+  int counts[64];
+  int num_counts = scale_thread_counts(a, max_threads, counts);
+  int num_batches = sizeof(SCALE_BATCHES) / sizeof(SCALE_BATCHES[0]);
+  int max_batch = SCALE_BATCHES[num_batches - 1];
+  int max_samples = 4 * max_threads * max_batch;
+  max_samples = (max_samples > DEFAULT_BENCHMARK_SIZE) ? max_samples : DEFAULT_BENCHMARK_SIZE;
+
+  int* samples = (int*)malloc(sizeof(int) * max_samples);
+  double** likelihoods = (double**)malloc(sizeof(double*) * max_samples);
+  for (int i = 0; i < max_samples; i++) {
+    samples[i] = i % CIFAR_BATCH_SIZE;
+    likelihoods[i] = (double*)malloc(sizeof(double) * NUM_CLASSES);
+  }
+  network_t* net = load_cnn_snapshot();
+  dataset();
+
+  if (json) {
+    printf("{\n  \"cpus\": %d,\n  \"cores\": %d,\n  \"packages\": %d,\n  \"points\": [", a->num_cpus,
+           a->num_cores, a->num_packages);
+  } else {
+    printf("# %d cpus, %d cores in %d packages\n", a->num_cpus, a->num_cores, a->num_packages);
+    printf("threads,batch,images,ms,images_per_s,speedup,efficiency\n");
+  }
+
+  double single[num_batches];
+  for (int c = 0; c < num_counts; c++) {
+    int threads = counts[c];
+    affinity_pin_team(a, threads);
+    for (int k = 0; k < num_batches; k++) {
+      net->batch_size = SCALE_BATCHES[k];
+      int n = 4 * threads * net->batch_size;
+      n = (n > DEFAULT_BENCHMARK_SIZE) ? n : DEFAULT_BENCHMARK_SIZE;
+
+      // One batch per thread warms up the code, the weights and the threads.
+      net_classify_fn(net, decode_sample, samples, likelihoods, threads * net->batch_size);
+      double best = 0;
+      for (int r = 0; r < SCALE_RUNS; r++) {
+        double start = monotonic_us();
+        net_classify_fn(net, decode_sample, samples, likelihoods, n);
+        double us = monotonic_us() - start;
+        best = (r == 0 || us < best) ? us : best;
+      }
+
+      double throughput = n / (best / 1e6);
+      single[k] = (c == 0) ? throughput : single[k];
+      double speedup = throughput / single[k];
+      double efficiency = speedup / threads;
+      if (json) {
+        printf("%s\n    {\"threads\": %d, \"batch\": %d, \"images\": %d, \"ms\": %.3lf, \"images_per_s\": %.1lf, "
+               "\"speedup\": %.3lf, \"efficiency\": %.3lf}",
+               (c > 0 || k > 0) ? "," : "", threads, net->batch_size, n, best / 1e3, throughput, speedup,
+               efficiency);
+      } else {
+        printf("%d,%d,%d,%.3lf,%.1lf,%.3lf,%.3lf\n", threads, net->batch_size, n, best / 1e3, throughput, speedup,
+               efficiency);
+      }
+      fflush(stdout);
+    }
+  }
+  if (json) {
+    printf("\n  ]\n}\n");
+  }
+
+  for (int i = 0; i < max_samples; i++) {
+    free(likelihoods[i]);
+  }
+  free(likelihoods);
+  free(samples);
+  free_network(net);
+  free_affinity(a);
+}
+#endif
+
 int main(int argc, char** argv) {
   if (argc < 2) {
-    printf("Usage: ./benchmark <benchmark|test|partest> [args]\n");
+    printf("Usage: ./benchmark <benchmark|harness|test|partest|calibrate|quant|convert|serve|profile|roofline|scale> [args]\n");
     return 2;
   }
 
@@ -309,6 +793,48 @@ int main(int argc, char** argv) {
     return 0;
   }
 
+  if (!strcmp(argv[1], "harness")) {
+    do_harness(argc - 2, argv + 2);
+    return 0;
+  }
+
+#ifndef BASELINE
+  if (!strcmp(argv[1], "calibrate")) {
+    do_calibrate(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "quant")) {
+    do_quant_test(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "convert")) {
+    do_convert(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "serve")) {
+    do_serve(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "profile")) {
+    do_profile(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "roofline")) {
+    do_roofline(argc - 2, argv + 2);
+    return 0;
+  }
+
+  if (!strcmp(argv[1], "scale")) {
+    do_scale(argc - 2, argv + 2);
+    return 0;
+  }
+#endif
+
   printf("ERROR: Unknown command\n");
 
   return 2;
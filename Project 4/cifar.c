@@ -0,0 +1,88 @@
+// mmap, fstat
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cifar.h"
+#include "volume.h"
+
+cifar_t* cifar_open(const char* folder)
+{
+  cifar_t* c = (cifar_t*)malloc(sizeof(cifar_t));
+
+  for (int i = 0; i < CIFAR_BATCHES; i++)
+  {
+    c->batches[i] = NULL;
+    c->sizes[i]   = 0;
+
+    char file_name[1024];
+    snprintf(file_name, sizeof(file_name), "%s/data_batch_%d.bin", folder, i + 1);
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0)
+    {
+      continue;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)CIFAR_RECORD_SIZE * CIFAR_BATCH_SIZE)
+    {
+      void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (data != MAP_FAILED)
+      {
+        c->batches[i] = data;
+        c->sizes[i]   = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  return c;
+}
+
+void cifar_close(cifar_t* c)
+{
+  for (int i = 0; i < CIFAR_BATCHES; i++)
+  {
+    if (c->batches[i] != NULL)
+    {
+      munmap((void*)c->batches[i], c->sizes[i]);
+    }
+  }
+  free(c);
+}
+
+static const uint8_t* cifar_record(cifar_t* c, int sample)
+{
+  assert(sample >= 0 && sample < CIFAR_BATCHES * CIFAR_BATCH_SIZE);
+  const uint8_t* batch = c->batches[sample / CIFAR_BATCH_SIZE];
+  assert(batch != NULL);
+  return batch + (size_t)(sample % CIFAR_BATCH_SIZE) * CIFAR_RECORD_SIZE;
+}
+
+int cifar_label(cifar_t* c, int sample)
+{
+  return cifar_record(c, sample)[0];
+}
+
+void cifar_decode(cifar_t* c, int sample, volume_t* v)
+{
+  const uint8_t* data = cifar_record(c, sample) + 1;
+
+  int outp = 0;
+  for (int d = 0; d < CIFAR_DEPTH; d++)
+  {
+    for (int y = 0; y < CIFAR_HEIGHT; y++)
+    {
+      for (int x = 0; x < CIFAR_WIDTH; x++)
+      {
+        volume_set(v, x, y, d, ((double)data[outp++]) / 255.0 - 0.5);
+      }
+    }
+  }
+}
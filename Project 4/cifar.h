@@ -0,0 +1,43 @@
+#ifndef CIFAR_H
+#define CIFAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+// Reader for the binary CIFAR-10 data set: 5 files data_batch_1.bin ..
+// data_batch_5.bin of 10,000 records each. A record is a label byte followed
+// by the 32x32 image as three 1024 byte planes (red, green, blue).
+//
+// The files are mapped rather than read, so only the pages of the records
+// that are actually used are ever loaded, and images stay in their 3 KB raw
+// form until cifar_decode turns one into a volume.
+
+#define CIFAR_BATCHES 5
+#define CIFAR_BATCH_SIZE 10000
+#define CIFAR_WIDTH 32
+#define CIFAR_HEIGHT 32
+#define CIFAR_DEPTH 3
+#define CIFAR_RECORD_SIZE (1 + CIFAR_WIDTH * CIFAR_HEIGHT * CIFAR_DEPTH)
+
+typedef struct cifar {
+  // Mapped batch files, NULL for files that could not be opened.
+  const uint8_t* batches[CIFAR_BATCHES];
+  size_t sizes[CIFAR_BATCHES];
+} cifar_t;
+
+// Maps the batch files in folder.
+cifar_t* cifar_open(const char* folder);
+
+// Unmaps the batch files.
+void cifar_close(cifar_t* c);
+
+// Returns the label of a sample (0 .. 49,999).
+int cifar_label(cifar_t* c, int sample);
+
+// Writes a sample, normalized to [-0.5, 0.5], into the interior of a 32x32x3
+// volume. Safe to call from several threads at once.
+void cifar_decode(cifar_t* c, int sample, volume_t* v);
+
+#endif
@@ -0,0 +1,396 @@
+// pthread_setaffinity_np, CPU_SET
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "affinity.h"
+#include "context.h"
+#include "network.h"
+#include "volume.h"
+
+// Keeps the deques and the counters of different workers on their own cache
+// lines.
+#define CACHE_LINE 64
+
+// Initial capacity of a deque, a power of 2. Deques grow as needed.
+#define DEQUE_CAPACITY 64
+
+// Images [first, first + count) of a request.
+typedef struct net_task {
+  net_request_t* req;
+  int first;
+  int count;
+} net_task_t;
+
+struct net_request {
+  net_input_fn input;
+  void* arg;
+  double** likelihoods;
+  int n;
+  net_task_t* tasks;
+  int finished;  // Images whose likelihoods are written
+};
+
+// Tasks [top, bottom) of a worker, at index & (capacity - 1) of the ring. The
+// owner takes from the top and thieves take from the bottom, where
+// submissions also go, so the owner runs its tasks in the order they were
+// submitted and thieves take the ones it would reach last.
+typedef struct net_deque {
+  pthread_mutex_t lock;
+  net_task_t** ring;
+  int capacity;
+  int top;
+  int bottom;
+} net_deque_t;
+
+typedef struct net_worker {
+  net_context_t* ctx;
+  pthread_t thread;
+  int id;
+  int cpu;  // CPU the worker is pinned to, -1 for none
+  net_deque_t deque;
+  net_worker_stats_t stats;
+  char pad[CACHE_LINE];
+} net_worker_t;
+
+struct net_context {
+  network_t* net;
+  int num_workers;
+  net_worker_t* workers;
+
+  // Workers sleep on work while no task is pending, and net_context_wait
+  // sleeps on done until its request is finished.
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int stop;
+
+  char pad0[CACHE_LINE];
+  int pending;    // Tasks submitted and not taken yet
+  char pad1[CACHE_LINE];
+  int next_deque; // Deque the next submitted task goes to
+  char pad2[CACHE_LINE];
+};
+
+static void deque_init(net_deque_t* q)
+{
+  pthread_mutex_init(&q->lock, NULL);
+  q->capacity = DEQUE_CAPACITY;
+  q->ring     = (net_task_t**)malloc(sizeof(net_task_t*) * q->capacity);
+  q->top      = 0;
+  q->bottom   = 0;
+}
+
+static void deque_destroy(net_deque_t* q)
+{
+  pthread_mutex_destroy(&q->lock);
+  free(q->ring);
+}
+
+static void deque_push(net_deque_t* q, net_task_t* task)
+{
+  pthread_mutex_lock(&q->lock);
+  if (q->bottom - q->top == q->capacity)
+  {
+    net_task_t** ring = (net_task_t**)malloc(sizeof(net_task_t*) * 2 * q->capacity);
+    for (int i = q->top; i < q->bottom; i++)
+    {
+      ring[i & (2 * q->capacity - 1)] = q->ring[i & (q->capacity - 1)];
+    }
+    free(q->ring);
+    q->ring = ring;
+    q->capacity *= 2;
+  }
+  q->ring[q->bottom & (q->capacity - 1)] = task;
+  __atomic_store_n(&q->bottom, q->bottom + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// Takes the oldest task (steal = 0) or the newest one (steal = 1), or returns
+// NULL if the deque is empty. pending counts the tasks of all deques.
+static net_task_t* deque_take(net_deque_t* q, int steal, int* pending)
+{
+  // Checked without the lock first, so searching empty deques is cheap.
+  if (__atomic_load_n(&q->bottom, __ATOMIC_RELAXED) == __atomic_load_n(&q->top, __ATOMIC_RELAXED))
+  {
+    return NULL;
+  }
+
+  net_task_t* task = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->top < q->bottom)
+  {
+    if (steal)
+    {
+      __atomic_store_n(&q->bottom, q->bottom - 1, __ATOMIC_RELAXED);
+      task = q->ring[q->bottom & (q->capacity - 1)];
+    }
+    else
+    {
+      task = q->ring[q->top & (q->capacity - 1)];
+      __atomic_store_n(&q->top, q->top + 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_sub(pending, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return task;
+}
+
+// Finds a task for worker w: from its own deque, or else from the others,
+// starting at a random one so that thieves spread over the victims.
+static net_task_t* context_find(net_context_t* ctx, net_worker_t* w, unsigned* seed)
+{
+  net_task_t* task = deque_take(&w->deque, 0, &ctx->pending);
+  if (task != NULL)
+  {
+    return task;
+  }
+
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  int others = ctx->num_workers - 1;
+  for (int k = 0; k < others; k++)
+  {
+    int victim = (w->id + 1 + (int)((*seed + k) % others)) % ctx->num_workers;
+    __atomic_fetch_add(&w->stats.attempts, 1, __ATOMIC_RELAXED);
+    task = deque_take(&ctx->workers[victim].deque, 1, &ctx->pending);
+    if (task != NULL)
+    {
+      __atomic_fetch_add(&w->stats.steals, 1, __ATOMIC_RELAXED);
+      return task;
+    }
+  }
+
+  return NULL;
+}
+
+// Blocks until a task may be pending. Returns 0 once the context is stopped
+// and every task has been run.
+static int context_sleep(net_context_t* ctx)
+{
+  // Tasks that are counted but not found are still being pushed.
+  if (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) > 0)
+  {
+    sched_yield();
+    return 1;
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  while (__atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) <= 0 && !ctx->stop)
+  {
+    pthread_cond_wait(&ctx->work, &ctx->lock);
+  }
+  int more = __atomic_load_n(&ctx->pending, __ATOMIC_ACQUIRE) > 0;
+  pthread_mutex_unlock(&ctx->lock);
+
+  return more;
+}
+
+static void* context_worker(void* arg)
+{
+  net_worker_t* w = (net_worker_t*)arg;
+  net_context_t* ctx = w->ctx;
+  network_t* net = ctx->net;
+
+  if (w->cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  // Made after pinning, so its pages are first touched from the worker's CPU.
+  int size = net->batch_size;
+  batch_t* b = make_inference_batch(net, size);
+  unsigned seed = 2463534242u + w->id;
+
+  for (;;)
+  {
+    net_task_t* task = context_find(ctx, w, &seed);
+    if (task == NULL)
+    {
+      if (!context_sleep(ctx))
+      {
+        break;
+      }
+      continue;
+    }
+
+    net_request_t* req = task->req;
+    for (int i = 0; i < task->count; i++)
+    {
+      req->input(req->arg, task->first + i, b[0][i]);
+    }
+    net_forward(net, b, 0, task->count - 1);
+    for (int i = 0; i < task->count; i++)
+    {
+      for (int j = 0; j < NUM_CLASSES; j++)
+      {
+        req->likelihoods[task->first + i][j] = b[11][i]->weights[j];
+      }
+    }
+    __atomic_fetch_add(&w->stats.tasks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&w->stats.images, task->count, __ATOMIC_RELAXED);
+
+    // The request may be released as soon as its last images are counted, so
+    // it is not touched after that.
+    int n = req->n;
+    if (__atomic_add_fetch(&req->finished, task->count, __ATOMIC_ACQ_REL) == n)
+    {
+      pthread_mutex_lock(&ctx->lock);
+      pthread_cond_broadcast(&ctx->done);
+      pthread_mutex_unlock(&ctx->lock);
+    }
+  }
+
+  free_batch(b, size);
+  return NULL;
+}
+
+net_context_t* make_net_context(network_t* net, int workers)
+{
+  net_context_t* ctx = (net_context_t*)malloc(sizeof(net_context_t));
+  ctx->net         = net;
+  ctx->num_workers = (workers > 0) ? workers : omp_get_max_threads();
+  ctx->workers     = (net_worker_t*)malloc(sizeof(net_worker_t) * ctx->num_workers);
+
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->work, NULL);
+  pthread_cond_init(&ctx->done, NULL);
+  ctx->stop       = 0;
+  ctx->pending    = 0;
+  ctx->next_deque = 0;
+
+  // Worker t is pinned to the t-th CPU of the affinity order, a physical core
+  // of its own while there are cores, unless there are more workers than
+  // CPUs.
+  affinity_t* affinity = make_affinity();
+
+  // Every deque exists before the first worker may try to steal from it.
+  for (int t = 0; t < ctx->num_workers; t++)
+  {
+    net_worker_t* w = &ctx->workers[t];
+    w->ctx = ctx;
+    w->id  = t;
+    w->cpu = (ctx->num_workers <= affinity->num_cpus) ? affinity->order[t] : -1;
+    deque_init(&w->deque);
+    memset(&w->stats, 0, sizeof(w->stats));
+  }
+  free_affinity(affinity);
+  for (int t = 0; t < ctx->num_workers; t++)
+  {
+    pthread_create(&ctx->workers[t].thread, NULL, context_worker, &ctx->workers[t]);
+  }
+
+  return ctx;
+}
+
+void free_net_context(net_context_t* ctx)
+{
+  pthread_mutex_lock(&ctx->lock);
+  ctx->stop = 1;
+  pthread_cond_broadcast(&ctx->work);
+  pthread_mutex_unlock(&ctx->lock);
+
+  for (int t = 0; t < ctx->num_workers; t++)
+  {
+    pthread_join(ctx->workers[t].thread, NULL);
+    deque_destroy(&ctx->workers[t].deque);
+  }
+
+  pthread_mutex_destroy(&ctx->lock);
+  pthread_cond_destroy(&ctx->work);
+  pthread_cond_destroy(&ctx->done);
+  free(ctx->workers);
+  free(ctx);
+}
+
+net_request_t* net_context_submit(net_context_t* ctx, net_input_fn input, void* arg, double** likelihoods, int n)
+{
+  net_request_t* req = (net_request_t*)malloc(sizeof(net_request_t));
+  req->input       = input;
+  req->arg         = arg;
+  req->likelihoods = likelihoods;
+  req->n           = n;
+  req->finished    = 0;
+
+  // Small groups are split into smaller tasks, so they still spread over all
+  // the workers.
+  int size  = ctx->net->batch_size;
+  int chunk = (n + ctx->num_workers - 1) / ctx->num_workers;
+  chunk = (chunk > size) ? size : chunk;
+  chunk = (chunk < 1) ? 1 : chunk;
+
+  int num_tasks = (n + chunk - 1) / chunk;
+  req->tasks = (net_task_t*)malloc(sizeof(net_task_t) * (num_tasks > 0 ? num_tasks : 1));
+  if (num_tasks == 0)
+  {
+    return req;
+  }
+  assert(!ctx->stop);
+
+  // Counted before they are pushed, so pending never falls behind the
+  // deques and no worker goes to sleep on a task it could run. Consecutive
+  // tasks go to consecutive deques, continuing where the last group left off.
+  __atomic_fetch_add(&ctx->pending, num_tasks, __ATOMIC_RELEASE);
+  int deque = __atomic_fetch_add(&ctx->next_deque, num_tasks, __ATOMIC_RELAXED);
+  for (int k = 0; k < num_tasks; k++)
+  {
+    net_task_t* task = &req->tasks[k];
+    task->req   = req;
+    task->first = k * chunk;
+    task->count = (n - task->first < chunk) ? n - task->first : chunk;
+    deque_push(&ctx->workers[(unsigned)(deque + k) % ctx->num_workers].deque, task);
+  }
+
+  pthread_mutex_lock(&ctx->lock);
+  pthread_cond_broadcast(&ctx->work);
+  pthread_mutex_unlock(&ctx->lock);
+
+  return req;
+}
+
+void net_context_wait(net_context_t* ctx, net_request_t* req)
+{
+  pthread_mutex_lock(&ctx->lock);
+  while (__atomic_load_n(&req->finished, __ATOMIC_ACQUIRE) < req->n)
+  {
+    pthread_cond_wait(&ctx->done, &ctx->lock);
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  free(req->tasks);
+  free(req);
+}
+
+void net_context_classify(net_context_t* ctx, net_input_fn input, void* arg, double** likelihoods, int n)
+{
+  net_context_wait(ctx, net_context_submit(ctx, input, arg, likelihoods, n));
+}
+
+int net_context_workers(net_context_t* ctx)
+{
+  return ctx->num_workers;
+}
+
+void net_context_stats(net_context_t* ctx, net_worker_stats_t* stats)
+{
+  for (int t = 0; t < ctx->num_workers; t++)
+  {
+    net_worker_stats_t* s = &ctx->workers[t].stats;
+    stats[t].tasks    = __atomic_load_n(&s->tasks, __ATOMIC_RELAXED);
+    stats[t].images   = __atomic_load_n(&s->images, __ATOMIC_RELAXED);
+    stats[t].steals   = __atomic_load_n(&s->steals, __ATOMIC_RELAXED);
+    stats[t].attempts = __atomic_load_n(&s->attempts, __ATOMIC_RELAXED);
+  }
+}
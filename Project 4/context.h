@@ -0,0 +1,57 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "network.h"
+
+// Long-lived inference context for classifying many small groups of images,
+// e.g. one group per request of a service. The context owns a pool of worker
+// threads, each pinned to a physical core of its own while there are cores
+// (see affinity.h) and holding a preallocated inference batch of
+// net->batch_size images, so a group costs neither thread start-up nor batch
+// allocation. Idle workers sleep until the next group is submitted.
+//
+// A group is split into tasks of up to net->batch_size images, which are
+// dealt out over per-worker deques. A worker runs the tasks of its own deque
+// oldest first, and once it is empty steals the newest task of another
+// worker's deque, so a worker that falls behind, e.g. because its core is
+// shared with another process, has its work taken over by the others.
+
+typedef struct net_context net_context_t;
+typedef struct net_request net_request_t;
+
+// Starts a context with the given number of worker threads
+// (omp_get_max_threads() if workers <= 0). The network must outlive the
+// context and must not be changed while it exists.
+net_context_t* make_net_context(network_t* net, int workers);
+
+// Stops the workers once all submitted groups are done and frees the context.
+void free_net_context(net_context_t* ctx);
+
+// Queues the classification of n images produced by input (see
+// net_classify_fn) and returns at once. May be called from several threads,
+// and several groups may be in flight. likelihoods[i] receives the
+// likelihoods of image i.
+net_request_t* net_context_submit(net_context_t* ctx, net_input_fn input, void* arg, double** likelihoods, int n);
+
+// Blocks until every image of a submitted group has been classified, and
+// releases the request.
+void net_context_wait(net_context_t* ctx, net_request_t* req);
+
+// Same as net_classify_fn, on the workers of the context.
+void net_context_classify(net_context_t* ctx, net_input_fn input, void* arg, double** likelihoods, int n);
+
+// Scheduling counters of a worker since the context was made.
+typedef struct net_worker_stats {
+  long tasks;     // Tasks run, stolen ones included
+  long images;    // Images classified
+  long steals;    // Tasks taken from another worker's deque
+  long attempts;  // Deques of other workers searched for a task
+} net_worker_stats_t;
+
+// Returns the number of workers of the context.
+int net_context_workers(net_context_t* ctx);
+
+// Fills stats[t] with the counters of worker t, for every worker.
+void net_context_stats(net_context_t* ctx, net_worker_stats_t* stats);
+
+#endif
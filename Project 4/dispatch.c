@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+#include "kernels.h"
+
+// The variants in increasing order of preference.
+static const kernels_t* const variants[] = {&kernels_scalar, &kernels_sse4, &kernels_avx2, &kernels_avx512};
+#define NUM_VARIANTS ((int)(sizeof(variants) / sizeof(variants[0])))
+
+// Returns the index in variants of the widest variant this CPU (and the
+// operating system, which has to save the wider registers) supports.
+static int cpu_best_variant()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    return 0;
+  }
+  int sse4 = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1) && (ecx & bit_SSE4_2);
+  if (!sse4)
+  {
+    return 0;
+  }
+  if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX) || !(ecx & bit_FMA))
+  {
+    return 1;
+  }
+
+  // XCR0: bits 1-2 are the SSE and AVX state, bits 5-7 the AVX-512 state.
+  unsigned xcr0_lo, xcr0_hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  if ((xcr0_lo & 0x06) != 0x06)
+  {
+    return 1;
+  }
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & bit_AVX2))
+  {
+    return 1;
+  }
+  if (!(ebx & bit_AVX512F) || !(ebx & bit_AVX512BW) || (xcr0_lo & 0xe0) != 0xe0)
+  {
+    return 2;
+  }
+  return 3;
+#else
+  return 0;
+#endif
+}
+
+static const kernels_t* selected = NULL;
+static pthread_once_t selected_once = PTHREAD_ONCE_INIT;
+
+static void kernels_select()
+{
+  int best = cpu_best_variant();
+  selected = variants[best];
+
+  const char* forced = getenv("KERNEL_ISA");
+  if (forced == NULL)
+  {
+    return;
+  }
+  for (int i = 0; i < NUM_VARIANTS; i++)
+  {
+    if (!strcmp(forced, variants[i]->name))
+    {
+      if (i > best)
+      {
+        fprintf(stderr, "KERNEL_ISA: this CPU does not support %s, using %s\n", forced, selected->name);
+      }
+      else
+      {
+        selected = variants[i];
+      }
+      return;
+    }
+  }
+  fprintf(stderr, "KERNEL_ISA: ignoring '%s'\n", forced);
+}
+
+const kernels_t* kernels()
+{
+  pthread_once(&selected_once, kernels_select);
+  return selected;
+}
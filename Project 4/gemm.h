@@ -0,0 +1,51 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include "layers.h"
+#include "simd.h"
+#include "volume.h"
+
+// Register tile of the GEMM microkernel shared by the convolution kernels:
+// GEMM_MR rows of A by GEMM_NR columns of B (see layers.h) are accumulated in
+// GEMM_MR * GEMM_NV vector registers.
+#define GEMM_NV (GEMM_NR / VLEN)
+
+// Adds the product of GEMM_MR consecutive rows of a (row stride lda) with
+// GEMM_NR consecutive columns of b (row stride ldb, 64 byte aligned) to the
+// tile of sums c, which stays in registers throughout.
+static inline void gemm_microkernel_acc(const real_t* a, const real_t* b, int k_len, int lda, int ldb,
+                                        vreal_t c[GEMM_MR][GEMM_NV])
+{
+  for (int k = 0; k < k_len; k++, b += ldb)
+  {
+    vreal_t b_k[GEMM_NV];
+    for (int v = 0; v < GEMM_NV; v++)
+    {
+      b_k[v] = vload(b + v * VLEN);
+    }
+    for (int r = 0; r < GEMM_MR; r++)
+    {
+      vreal_t a_rk = vbroadcast(&a[r * lda + k]);
+      for (int v = 0; v < GEMM_NV; v++)
+      {
+        c[r][v] = vfmadd(a_rk, b_k[v], c[r][v]);
+      }
+    }
+  }
+}
+
+// Same as gemm_microkernel_acc, starting from a zero tile.
+static inline void gemm_microkernel(const real_t* a, const real_t* b, int k_len, int lda, int ldb,
+                                    vreal_t c[GEMM_MR][GEMM_NV])
+{
+  for (int r = 0; r < GEMM_MR; r++)
+  {
+    for (int v = 0; v < GEMM_NV; v++)
+    {
+      c[r][v] = vzero();
+    }
+  }
+  gemm_microkernel_acc(a, b, k_len, lda, ldb, c);
+}
+
+#endif
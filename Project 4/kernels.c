@@ -0,0 +1,790 @@
+// Compiled once per instruction set, with KERNEL_ISA set to the variant's
+// name (see kernels.h and the Makefile). Everything but the table at the end
+// is static, so the copies do not clash.
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "gemm.h"
+#include "kernels.h"
+#include "layers.h"
+#include "quant.h"
+#include "simd.h"
+#include "volume.h"
+#include "winograd.h"
+
+// Number of register tiles the conv kernels fill at once. With AVX-512 the
+// GEMM_NR columns of a tile fit in one register, so a single tile is only
+// GEMM_MR independent FMA chains, too few to cover the FMA latency; two tiles
+// sharing the loads of b still leave most of the 32 registers free.
+#if defined(__AVX512F__)
+#define CONV_TILES 2
+#else
+#define CONV_TILES 1
+#endif
+
+// gemm_microkernel_acc for CONV_TILES tiles whose rows start at a[t].
+static inline void conv_microkernel_acc(const real_t* const a[CONV_TILES], const real_t* b, int k_len, int lda,
+                                        int ldb, vreal_t c[CONV_TILES][GEMM_MR][GEMM_NV])
+{
+  for (int k = 0; k < k_len; k++, b += ldb)
+  {
+    vreal_t b_k[GEMM_NV];
+    for (int v = 0; v < GEMM_NV; v++)
+    {
+      b_k[v] = vload(b + v * VLEN);
+    }
+    for (int t = 0; t < CONV_TILES; t++)
+    {
+      for (int r = 0; r < GEMM_MR; r++)
+      {
+        vreal_t a_rk = vbroadcast(&a[t][r * lda + k]);
+        for (int v = 0; v < GEMM_NV; v++)
+        {
+          c[t][r][v] = vfmadd(a_rk, b_k[v], c[t][r][v]);
+        }
+      }
+    }
+  }
+}
+
+static inline void conv_zero_tiles(vreal_t c[CONV_TILES][GEMM_MR][GEMM_NV])
+{
+  for (int t = 0; t < CONV_TILES; t++)
+  {
+    for (int r = 0; r < GEMM_MR; r++)
+    {
+      for (int v = 0; v < GEMM_NV; v++)
+      {
+        c[t][r][v] = vzero();
+      }
+    }
+  }
+}
+
+// Returns how many of the next CONV_TILES tiles hold any of the remaining
+// rows. The kernels still fill all CONV_TILES, repeating the last real one,
+// and only store the real ones.
+static inline int conv_tiles(int rows)
+{
+  int tiles = (rows + GEMM_MR - 1) / GEMM_MR;
+  return (tiles < CONV_TILES) ? tiles : CONV_TILES;
+}
+
+// Adds bias to one row of a register tile and stores the first n values (all
+// GEMM_NR when n is larger) to out.
+static inline void store_row(real_t* out, vreal_t c[GEMM_NV], const real_t* bias, int n)
+{
+  if (n >= GEMM_NR)
+  {
+    for (int v = 0; v < GEMM_NV; v++)
+    {
+      vstoreu(out + v * VLEN, vadd(c[v], vloadu(bias + v * VLEN)));
+    }
+    return;
+  }
+
+#if defined(__AVX512F__)
+  // E.g. channels 16-19 of a 20 channel layer.
+  for (int v = 0; v < GEMM_NV && v * VLEN < n; v++)
+  {
+    vmask_t m = vmask_first((n - v * VLEN < VLEN) ? n - v * VLEN : VLEN);
+    vmaskstoreu(out + v * VLEN, m, vadd(c[v], vmaskloadu(m, bias + v * VLEN)));
+  }
+#else
+  real_t p[GEMM_NR];
+  for (int v = 0; v < GEMM_NV; v++)
+  {
+    vstoreu(p + v * VLEN, c[v]);
+  }
+  for (int j = 0; j < n; j++)
+  {
+    out[j] = p[j] + bias[j];
+  }
+#endif
+}
+
+// Adds the biases of output channels [f, f + GEMM_NR) to the first rows rows
+// of a register tile and stores them to dst[i] + f.
+static inline void conv_store_tile(conv_layer_t* l, vreal_t c[GEMM_MR][GEMM_NV], int f, int rows, real_t** dst)
+{
+  for (int i = 0; i < rows; i++)
+  {
+    store_row(dst[i] + f, c[i], &l->biases->weights[f], l->output_depth - f);
+  }
+}
+
+static void conv_gemm(conv_layer_t* l, const real_t* panel, int rows, real_t** dst)
+{
+  int k_len = l->num_weights;
+
+  for (int r = 0; r < rows; r += CONV_TILES * GEMM_MR)
+  {
+    int tiles = conv_tiles(rows - r);
+    const real_t* a[CONV_TILES];
+    for (int t = 0; t < CONV_TILES; t++)
+    {
+      a[t] = panel + (r + ((t < tiles) ? t : tiles - 1) * GEMM_MR) * k_len;
+    }
+    for (int f = 0; f < l->output_depth; f += GEMM_NR)
+    {
+      vreal_t c[CONV_TILES][GEMM_MR][GEMM_NV];
+      conv_zero_tiles(c);
+      conv_microkernel_acc(a, l->packed + f * k_len, k_len, k_len, GEMM_NR, c);
+      for (int t = 0; t < tiles; t++)
+      {
+        int left = rows - r - t * GEMM_MR;
+        conv_store_tile(l, c[t], f, (left < GEMM_MR) ? left : GEMM_MR, dst + r + t * GEMM_MR);
+      }
+    }
+  }
+}
+
+// Each filter row is one run of filter_width * input_depth broadcast-FMA
+// steps against the matching rows of a packed filter block. Always inlined, so
+// that the specialized kernels below see their shape as constants: the runs
+// then have a fixed length the compiler unrolls, and the tile offsets fold.
+static inline __attribute__((always_inline)) void conv_direct_shape(conv_layer_t* l, volume_t** inputs, int start,
+                                                                    int row, int rows, real_t** dst, int fw, int fh,
+                                                                    int depth, int stride)
+{
+  int pixels = l->output_width * l->output_height;
+  int run = fw * depth;
+  int k_len = fw * fh * depth;
+  int lda = volume_offset(inputs[start], 0, 1, 0);
+
+  for (int r = 0; r < rows; r += CONV_TILES * GEMM_MR, row += CONV_TILES * GEMM_MR)
+  {
+    // The tiles may start in different rows or images.
+    int tiles = conv_tiles(rows - r);
+    const real_t* a[CONV_TILES];
+    for (int t = 0; t < CONV_TILES; t++)
+    {
+      int tile_row = row + ((t < tiles) ? t : tiles - 1) * GEMM_MR;
+      volume_t* in = inputs[start + tile_row / pixels];
+      int pixel = tile_row % pixels;
+      int y = (pixel / l->output_width) * stride - l->pad;
+      int x = (pixel % l->output_width) * stride - l->pad;
+      a[t] = &in->weights[volume_offset(in, x, y, 0)];
+    }
+    for (int f = 0; f < l->output_depth; f += GEMM_NR)
+    {
+      const real_t* b = l->packed + f * k_len;
+      vreal_t c[CONV_TILES][GEMM_MR][GEMM_NV];
+      conv_zero_tiles(c);
+      for (int fy = 0; fy < fh; fy++)
+      {
+        const real_t* a_fy[CONV_TILES];
+        for (int t = 0; t < CONV_TILES; t++)
+        {
+          a_fy[t] = a[t] + fy * lda;
+        }
+        conv_microkernel_acc(a_fy, b + fy * run * GEMM_NR, run, stride * depth, GEMM_NR, c);
+      }
+      for (int t = 0; t < tiles; t++)
+      {
+        conv_store_tile(l, c[t], f, GEMM_MR, dst + r + t * GEMM_MR);
+      }
+    }
+  }
+}
+
+static void conv_direct(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, real_t** dst)
+{
+  conv_direct_shape(l, inputs, start, row, rows, dst, l->filter_width, l->filter_height, l->input_depth, l->stride);
+}
+
+// Layer shapes with a specialized direct kernel, as (filter width, filter
+// height, input depth, stride): those of the CIFAR-10 network. Add a line to
+// specialize another shape; the rest run the generic conv_direct.
+#define CONV_DIRECT_SHAPES(X) \
+  X(5, 5, 3, 1)               \
+  X(5, 5, 16, 1)              \
+  X(5, 5, 20, 1)
+
+#define CONV_DIRECT_NAME(fw, fh, depth, stride) conv_direct_##fw##x##fh##x##depth##_s##stride
+
+#define CONV_DIRECT_DEFINE(fw, fh, depth, stride)                                                            \
+  static void CONV_DIRECT_NAME(fw, fh, depth, stride)(conv_layer_t* l, volume_t** inputs, int start, int row, \
+                                                      int rows, real_t** dst)                                \
+  {                                                                                                          \
+    conv_direct_shape(l, inputs, start, row, rows, dst, fw, fh, depth, stride);                              \
+  }
+
+CONV_DIRECT_SHAPES(CONV_DIRECT_DEFINE)
+
+static const struct
+{
+  int fw, fh, depth, stride;
+  conv_direct_fn fn;
+} conv_direct_shapes[] = {
+#define CONV_DIRECT_ENTRY(fw, fh, depth, stride) {fw, fh, depth, stride, CONV_DIRECT_NAME(fw, fh, depth, stride)},
+  CONV_DIRECT_SHAPES(CONV_DIRECT_ENTRY)
+#undef CONV_DIRECT_ENTRY
+};
+#define NUM_CONV_DIRECT_SHAPES ((int)(sizeof(conv_direct_shapes) / sizeof(conv_direct_shapes[0])))
+
+static conv_direct_fn conv_direct_for(const conv_layer_t* l)
+{
+  for (int i = 0; i < NUM_CONV_DIRECT_SHAPES; i++)
+  {
+    if (conv_direct_shapes[i].fw == l->filter_width && conv_direct_shapes[i].fh == l->filter_height &&
+        conv_direct_shapes[i].depth == l->input_depth && conv_direct_shapes[i].stride == l->stride)
+    {
+      return conv_direct_shapes[i].fn;
+    }
+  }
+  return conv_direct;
+}
+
+// Applies B^T to 6 vectors of n values (vector i at in + i * is) and writes
+// the 6 results to out + i * os.
+static inline void winograd_bt(const real_t* in, int is, real_t* out, int os, int n)
+{
+  for (int d = 0; d < n; d++)
+  {
+    real_t d0 = in[d];
+    real_t d1 = in[is + d];
+    real_t d2 = in[2 * is + d];
+    real_t d3 = in[3 * is + d];
+    real_t d4 = in[4 * is + d];
+    real_t d5 = in[5 * is + d];
+
+    out[d]          = 4 * d0 - 5 * d2 + d4;
+    out[os + d]     = -4 * (d1 + d2) + d3 + d4;
+    out[2 * os + d] = 4 * (d1 - d2) - d3 + d4;
+    out[3 * os + d] = 2 * (d3 - d1) - d2 + d4;
+    out[4 * os + d] = 2 * (d1 - d3) - d2 + d4;
+    out[5 * os + d] = 4 * d1 - 5 * d3 + d5;
+  }
+}
+
+// Applies A^T to 6 vectors of n values and writes the 2 results.
+static inline void winograd_at(const real_t* in, int is, real_t* out, int os, int n)
+{
+  for (int f = 0; f < n; f++)
+  {
+    real_t m0 = in[f];
+    real_t m1 = in[is + f];
+    real_t m2 = in[2 * is + f];
+    real_t m3 = in[3 * is + f];
+    real_t m4 = in[4 * is + f];
+    real_t m5 = in[5 * is + f];
+
+    out[f]      = m0 + m1 + m2 + m3 + m4;
+    out[os + f] = m1 - m2 + 2 * (m3 - m4) + m5;
+  }
+}
+
+// B^T is applied to the tile's columns first, then to the rows of the result.
+static void winograd_input(const real_t* src, int stride, int depth, real_t* tmp, real_t* v, int vs)
+{
+  for (int tx = 0; tx < WINO_A; tx++)
+  {
+    winograd_bt(src + tx * depth, stride, tmp + tx * depth, WINO_A * depth, depth);
+  }
+  for (int a = 0; a < WINO_A; a++)
+  {
+    winograd_bt(tmp + a * WINO_A * depth, depth, v + a * WINO_A * vs, vs, depth);
+  }
+}
+
+static void winograd_gemm(conv_layer_t* l, const real_t* v, int tiles, real_t* m)
+{
+  int depth = l->input_depth;
+  int ldb = l->packed_depth;
+
+  for (int e = 0; e < WINO_A * WINO_A; e++)
+  {
+    const real_t* a = v + e * tiles * depth;
+    const real_t* b = l->winograd + e * depth * ldb;
+    for (int r = 0; r < tiles; r += CONV_TILES * GEMM_MR)
+    {
+      int n = conv_tiles(tiles - r);
+      const real_t* a_t[CONV_TILES];
+      for (int t = 0; t < CONV_TILES; t++)
+      {
+        a_t[t] = a + (r + ((t < n) ? t : n - 1) * GEMM_MR) * depth;
+      }
+      for (int f = 0; f < ldb; f += GEMM_NR)
+      {
+        vreal_t c[CONV_TILES][GEMM_MR][GEMM_NV];
+        conv_zero_tiles(c);
+        conv_microkernel_acc(a_t, b + f, depth, depth, ldb, c);
+        for (int t = 0; t < n; t++)
+        {
+          for (int i = 0; i < GEMM_MR; i++)
+          {
+            real_t* dst = m + (e * tiles + r + t * GEMM_MR + i) * ldb + f;
+            for (int k = 0; k < GEMM_NV; k++)
+            {
+              vstoreu(dst + k * VLEN, c[t][i][k]);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+static void winograd_output(const real_t* m, int ms, int ldb, int n, real_t* at, real_t* y)
+{
+  for (int b = 0; b < WINO_A; b++)
+  {
+    winograd_at(m + b * ms, WINO_A * ms, at + b * ldb, WINO_A * ldb, n);
+  }
+  for (int i = 0; i < WINO_M; i++)
+  {
+    winograd_at(at + i * WINO_A * ldb, ldb, y + i * WINO_M * ldb, ldb, n);
+  }
+}
+
+// Horizontal sum and maximum: reduce the lanes of a vector to one value.
+static inline real_t vhsum(vreal_t a)
+{
+  real_t lanes[VLEN];
+  vstoreu(lanes, a);
+  real_t sum = 0.0;
+  for (int k = 0; k < VLEN; k++)
+  {
+    sum += lanes[k];
+  }
+  return sum;
+}
+
+static inline real_t vhmax(vreal_t a)
+{
+  real_t lanes[VLEN];
+  vstoreu(lanes, a);
+  real_t m = lanes[0];
+  for (int k = 1; k < VLEN; k++)
+  {
+    m = (lanes[k] > m) ? lanes[k] : m;
+  }
+  return m;
+}
+
+// Register block of the fc GEMM: FC_MR inputs by FC_NR filters, each
+// accumulated in one vector over the inputs' values and reduced at the end.
+// The fc layer has few outputs (10), far fewer than GEMM_NR columns would
+// need, so the dot products are vectorized along num_inputs instead.
+#if defined(__AVX512F__)
+#define FC_MR 4
+#else
+#define FC_MR 2
+#endif
+#define FC_NR 4
+
+// Computes the dot product (i.e. the sum of the elementwise product) of each
+// input's weights with each row of the packed filters. An FC_MR x FC_NR block
+// loads every input and filter vector once for FC_MR * FC_NR FMAs, and the
+// inputs are read in place.
+static void fc(fc_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  int n = l->num_inputs;
+  int n_vec = n - n % VLEN;
+
+  for (int j = start; j <= end; j += FC_MR)
+  {
+    // Rows and columns past the edge repeat the last input or filter and are
+    // not stored.
+    int rows = (end - j + 1 < FC_MR) ? end - j + 1 : FC_MR;
+    const real_t* x[FC_MR];
+    for (int m = 0; m < FC_MR; m++)
+    {
+      x[m] = inputs[j + ((m < rows) ? m : rows - 1)]->weights;
+    }
+
+    for (int i = 0; i < l->output_depth; i += FC_NR)
+    {
+      int cols = (l->output_depth - i < FC_NR) ? l->output_depth - i : FC_NR;
+      const real_t* w[FC_NR];
+      for (int t = 0; t < FC_NR; t++)
+      {
+        w[t] = l->packed + (i + ((t < cols) ? t : cols - 1)) * n;
+      }
+
+      vreal_t acc[FC_MR][FC_NR];
+      for (int m = 0; m < FC_MR; m++)
+      {
+        for (int t = 0; t < FC_NR; t++)
+        {
+          acc[m][t] = vzero();
+        }
+      }
+      for (int d = 0; d < n_vec; d += VLEN)
+      {
+        vreal_t x_d[FC_MR];
+        for (int m = 0; m < FC_MR; m++)
+        {
+          x_d[m] = vloadu(x[m] + d);
+        }
+        for (int t = 0; t < FC_NR; t++)
+        {
+          vreal_t w_d = vloadu(w[t] + d);
+          for (int m = 0; m < FC_MR; m++)
+          {
+            acc[m][t] = vfmadd(x_d[m], w_d, acc[m][t]);
+          }
+        }
+      }
+#if defined(__AVX512F__)
+      if (n_vec < n)
+      {
+        vmask_t tail = vmask_first(n - n_vec);
+        for (int t = 0; t < FC_NR; t++)
+        {
+          vreal_t w_d = vmaskloadu(tail, w[t] + n_vec);
+          for (int m = 0; m < FC_MR; m++)
+          {
+            acc[m][t] = vfmadd(vmaskloadu(tail, x[m] + n_vec), w_d, acc[m][t]);
+          }
+        }
+      }
+#endif
+
+      for (int m = 0; m < rows; m++)
+      {
+        for (int t = 0; t < cols; t++)
+        {
+          real_t dot = vhsum(acc[m][t]);
+#if !defined(__AVX512F__)
+          for (int d = n_vec; d < n; d++)
+          {
+            dot += x[m][d] * w[t][d];
+          }
+#endif
+          outputs[j + m]->weights[i + t] = dot + l->biases->weights[i + t];
+        }
+      }
+    }
+  }
+}
+
+// e^x for x <= 0, to within a few ulp. x = n ln2 + r with integral n and
+// |r| <= ln2 / 2 (ln2 split in two so n ln2 is exact enough), e^r comes from
+// its Taylor series, and e^x = 2^n e^r. Inputs below EXP_MIN are clamped to
+// it, which keeps 2^n e^r normal; softmax only takes e^x of inputs minus
+// their maximum, and next to the e^0 = 1 in every sum e^EXP_MIN is noise.
+#ifdef USE_FLOAT
+#define EXP_MIN    -86.0
+#define EXP_LN2_HI 0.693359375
+#define EXP_LN2_LO -2.12194440e-4
+#define EXP_TERMS  7
+#else
+#define EXP_MIN    -708.0
+#define EXP_LN2_HI 0.693145751953125
+#define EXP_LN2_LO 1.42860682030941723212e-6
+#define EXP_TERMS  13
+#endif
+
+static inline vreal_t vexp(vreal_t x)
+{
+  x = vmax(x, vset1(EXP_MIN));
+  vreal_t n = vround(vmul(x, vset1(1.44269504088896340736)));
+  vreal_t r = vfmadd(n, vset1(-EXP_LN2_HI), x);
+  r = vfmadd(n, vset1(-EXP_LN2_LO), r);
+
+  // Horner's scheme for sum r^k / k!, k = 0 .. EXP_TERMS
+  vreal_t p = vset1(1.0);
+  for (int k = EXP_TERMS; k > 0; k--)
+  {
+    p = vfmadd(vmul(p, r), vset1(1.0 / k), vset1(1.0));
+  }
+  return vldexp(p, n);
+}
+
+// Layers with at least this many classes run softmax_wide; below it, the
+// transposes of softmax_narrow are cheaper than reducing every image's
+// vectors. The two break even around 40-64 classes with every ISA.
+#define SOFTMAX_WIDE 48
+
+// Softmax of one image, vectorized along the classes. The last depth % VLEN
+// classes are padded with -inf, whose e^x (e^EXP_MIN, see vexp) does not
+// change the sum.
+static void softmax_wide(int depth, const real_t* in_weights, real_t* out_weights)
+{
+  int full = depth - depth % VLEN;
+  real_t tail[VLEN];
+  for (int k = 0; k < VLEN; k++)
+  {
+    tail[k] = (full + k < depth) ? in_weights[full + k] : -INFINITY;
+  }
+
+  // Compute max activation (used to compute exponentials)
+  vreal_t amax = vloadu(tail);
+  for (int c = 0; c < full; c += VLEN)
+  {
+    amax = vmax(amax, vloadu(in_weights + c));
+  }
+  vreal_t vmax_all = vset1(vhmax(amax));
+
+  // Compute exponentials in a numerically stable way
+  vreal_t total = vexp(vsub(vloadu(tail), vmax_all));
+  vstoreu(tail, total);
+  for (int c = 0; c < full; c += VLEN)
+  {
+    vreal_t e = vexp(vsub(vloadu(in_weights + c), vmax_all));
+    total = vadd(total, e);
+    vstoreu(out_weights + c, e);
+  }
+
+  // Normalize and output to sum to one
+  real_t sum = vhsum(total);
+  vreal_t vsum = vset1(sum);
+  for (int c = 0; c < full; c += VLEN)
+  {
+    vstoreu(out_weights + c, vdiv(vloadu(out_weights + c), vsum));
+  }
+  for (int c = full; c < depth; c++)
+  {
+    out_weights[c] = tail[c - full] / sum;
+  }
+}
+
+// Softmax of VLEN images at a time, transposed so that lane i holds image
+// j + i: the max, the exponentials, their sum and the division then run on
+// whole vectors whatever the number of classes. Lanes past end repeat the
+// last image and are not stored.
+static void softmax_narrow(int depth, volume_t** inputs, volume_t** outputs, int j, int end)
+{
+  real_t likelihoods[depth * VLEN];
+
+  int images = (end - j + 1 < VLEN) ? end - j + 1 : VLEN;
+  for (int i = 0; i < VLEN; i++)
+  {
+    const real_t* in_weights = inputs[j + ((i < images) ? i : images - 1)]->weights;
+    for (int c = 0; c < depth; c++)
+    {
+      likelihoods[c * VLEN + i] = in_weights[c];
+    }
+  }
+
+  // Compute max activation (used to compute exponentials)
+  vreal_t amax = vloadu(likelihoods);
+  for (int c = 1; c < depth; c++)
+  {
+    amax = vmax(amax, vloadu(likelihoods + c * VLEN));
+  }
+
+  // Compute exponentials in a numerically stable way
+  vreal_t total = vzero();
+  for (int c = 0; c < depth; c++)
+  {
+    vreal_t e = vexp(vsub(vloadu(likelihoods + c * VLEN), amax));
+    total = vadd(total, e);
+    vstoreu(likelihoods + c * VLEN, e);
+  }
+
+  // Normalize and output to sum to one
+  for (int c = 0; c < depth; c++)
+  {
+    vstoreu(likelihoods + c * VLEN, vdiv(vloadu(likelihoods + c * VLEN), total));
+  }
+  for (int i = 0; i < images; i++)
+  {
+    real_t* out_weights = outputs[j + i]->weights;
+    for (int c = 0; c < depth; c++)
+    {
+      out_weights[c] = likelihoods[c * VLEN + i];
+    }
+  }
+}
+
+static void softmax(softmax_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  int depth = l->output_depth;
+
+  if (depth >= SOFTMAX_WIDE)
+  {
+    for (int j = start; j <= end; j++)
+    {
+      softmax_wide(depth, inputs[j]->weights, outputs[j]->weights);
+    }
+    return;
+  }
+  for (int j = start; j <= end; j += VLEN)
+  {
+    softmax_narrow(depth, inputs, outputs, j, end);
+  }
+}
+
+// Multiplies QUANT_MR panel rows with QUANT_NR packed output channels into
+// int32 sums. Each step takes 4 activation bytes of a row and multiplies them
+// with the matching 4 weights of every channel; with SIMD, maddubs + madd sum
+// the 4 products of a channel into its int32 lane.
+static inline void quant_microkernel(const uint8_t* a, const int8_t* b, int k4_len, int lda, int ldb,
+                                     int32_t c[QUANT_MR][QUANT_NR])
+{
+#if defined(__AVX512BW__)
+  const __m512i ones = _mm512_set1_epi16(1);
+  __m512i acc[QUANT_MR];
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    acc[r] = _mm512_setzero_si512();
+  }
+  for (int k4 = 0; k4 < k4_len; k4++, b += ldb)
+  {
+    __m512i b0 = _mm512_load_si512((const void*)b);
+    for (int r = 0; r < QUANT_MR; r++)
+    {
+      int32_t a4;
+      memcpy(&a4, &a[r * lda + k4 * 4], sizeof(a4));
+      acc[r] = _mm512_add_epi32(acc[r], _mm512_madd_epi16(_mm512_maddubs_epi16(_mm512_set1_epi32(a4), b0), ones));
+    }
+  }
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    _mm512_storeu_si512((void*)c[r], acc[r]);
+  }
+#elif defined(__AVX2__)
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc[QUANT_MR][2];
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    acc[r][0] = _mm256_setzero_si256();
+    acc[r][1] = _mm256_setzero_si256();
+  }
+  for (int k4 = 0; k4 < k4_len; k4++, b += ldb)
+  {
+    __m256i b0 = _mm256_load_si256((const __m256i*)b);
+    __m256i b1 = _mm256_load_si256((const __m256i*)(b + 32));
+    for (int r = 0; r < QUANT_MR; r++)
+    {
+      int32_t a4;
+      memcpy(&a4, &a[r * lda + k4 * 4], sizeof(a4));
+      __m256i a_rk = _mm256_set1_epi32(a4);
+      acc[r][0] = _mm256_add_epi32(acc[r][0], _mm256_madd_epi16(_mm256_maddubs_epi16(a_rk, b0), ones));
+      acc[r][1] = _mm256_add_epi32(acc[r][1], _mm256_madd_epi16(_mm256_maddubs_epi16(a_rk, b1), ones));
+    }
+  }
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    _mm256_storeu_si256((__m256i*)c[r], acc[r][0]);
+    _mm256_storeu_si256((__m256i*)(c[r] + 8), acc[r][1]);
+  }
+#elif defined(__SSSE3__)
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc[QUANT_MR][4];
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    for (int v = 0; v < 4; v++)
+    {
+      acc[r][v] = _mm_setzero_si128();
+    }
+  }
+  for (int k4 = 0; k4 < k4_len; k4++, b += ldb)
+  {
+    __m128i b_k[4];
+    for (int v = 0; v < 4; v++)
+    {
+      b_k[v] = _mm_load_si128((const __m128i*)(b + 16 * v));
+    }
+    for (int r = 0; r < QUANT_MR; r++)
+    {
+      int32_t a4;
+      memcpy(&a4, &a[r * lda + k4 * 4], sizeof(a4));
+      __m128i a_rk = _mm_set1_epi32(a4);
+      for (int v = 0; v < 4; v++)
+      {
+        acc[r][v] = _mm_add_epi32(acc[r][v], _mm_madd_epi16(_mm_maddubs_epi16(a_rk, b_k[v]), ones));
+      }
+    }
+  }
+  for (int r = 0; r < QUANT_MR; r++)
+  {
+    for (int v = 0; v < 4; v++)
+    {
+      _mm_storeu_si128((__m128i*)(c[r] + 4 * v), acc[r][v]);
+    }
+  }
+#else
+  memset(c, 0, sizeof(int32_t) * QUANT_MR * QUANT_NR);
+  for (int k4 = 0; k4 < k4_len; k4++, b += ldb)
+  {
+    for (int r = 0; r < QUANT_MR; r++)
+    {
+      const uint8_t* a_rk = &a[r * lda + k4 * 4];
+      for (int j = 0; j < QUANT_NR; j++)
+      {
+        c[r][j] += a_rk[0] * b[j * 4] + a_rk[1] * b[j * 4 + 1] + a_rk[2] * b[j * 4 + 2] + a_rk[3] * b[j * 4 + 3];
+      }
+    }
+  }
+#endif
+}
+
+static void quant_gemm(quant_t* q, const uint8_t* panel, int rows, real_t** dst, const real_t* bias)
+{
+  int lda = q->padded_inputs;
+  int ldb = q->packed_outputs * 4;
+
+  for (int r = 0; r < rows; r += QUANT_MR)
+  {
+    for (int f = 0; f < q->num_outputs; f += QUANT_NR)
+    {
+      int32_t acc[QUANT_MR][QUANT_NR];
+      quant_microkernel(panel + r * lda, q->packed + f * 4, lda / 4, lda, ldb, acc);
+
+      int cols = (q->num_outputs - f < QUANT_NR) ? q->num_outputs - f : QUANT_NR;
+      for (int i = 0; i < QUANT_MR && r + i < rows; i++)
+      {
+        for (int j = 0; j < cols; j++)
+        {
+          dst[r + i][f + j] = q->out_scales[f + j] * (acc[i][j] - q->corrections[f + j]) + bias[f + j];
+        }
+      }
+    }
+  }
+}
+
+// Independent accumulators of peak_fma: enough to cover the latency of a
+// multiply-add times the number of units issuing them on current cores.
+#define PEAK_CHAINS 12
+
+// Runs iterations rounds of PEAK_CHAINS independent vector multiply-adds and
+// returns the flops done. The accumulators converge to 1 instead of growing
+// or going subnormal, and their sum goes to sink to keep the loop alive.
+static double peak_fma(long iterations, real_t* sink)
+{
+  vreal_t acc[PEAK_CHAINS];
+  for (int i = 0; i < PEAK_CHAINS; i++)
+  {
+    acc[i] = vset1((real_t)i);
+  }
+  vreal_t m = vset1((real_t)0.999);
+  vreal_t c = vset1((real_t)0.001);
+
+  for (long k = 0; k < iterations; k++)
+  {
+    for (int i = 0; i < PEAK_CHAINS; i++)
+    {
+      acc[i] = vfmadd(acc[i], m, c);
+    }
+  }
+
+  for (int i = 1; i < PEAK_CHAINS; i++)
+  {
+    acc[0] = vadd(acc[0], acc[i]);
+  }
+  *sink = vhsum(acc[0]);
+  return 2.0 * PEAK_CHAINS * VLEN * iterations;
+}
+
+#define KERNELS_STR_(isa) #isa
+#define KERNELS_STR(isa) KERNELS_STR_(isa)
+#define KERNELS_TABLE_(isa) kernels_##isa
+#define KERNELS_TABLE(isa) KERNELS_TABLE_(isa)
+
+const kernels_t KERNELS_TABLE(KERNEL_ISA) = {
+  KERNELS_STR(KERNEL_ISA),
+  conv_gemm,
+  conv_direct_for,
+  winograd_input,
+  winograd_gemm,
+  winograd_output,
+  fc,
+  softmax,
+  quant_gemm,
+  peak_fma,
+};
@@ -0,0 +1,72 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+#include "layers.h"
+#include "quant.h"
+#include "volume.h"
+
+// Compute kernels of the conv, fc and softmax layers. kernels.c is compiled
+// once per instruction set (see the Makefile), and kernels() picks the widest
+// variant the CPU supports when it is first called, so one binary runs on
+// any x86-64 CPU. The KERNEL_ISA environment variable (scalar, sse4, avx2 or
+// avx512) forces a variant, e.g. for benchmarking.
+typedef struct kernels {
+  const char* name;
+
+  // Multiplies rows of an im2col panel (rows x num_weights, zero padded up to
+  // a multiple of GEMM_MR rows) with the packed filters and writes the
+  // output_depth results of row i, bias included, to dst[i].
+  void (*conv_gemm)(conv_layer_t* l, const real_t* panel, int rows, real_t** dst);
+
+  // Returns the direct counterpart of conv_gemm for inputs with a halo (see
+  // volume.h): the GEMM_MR output pixels of a register tile are horizontally
+  // adjacent, so their input windows start stride * input_depth values apart
+  // and the tile reads them in place instead of from an im2col panel. The
+  // kernel computes output pixels [row, row + rows) of the batch starting at
+  // image start; row and rows must be multiples of GEMM_MR. Shapes listed in
+  // CONV_DIRECT_SHAPES (kernels.c) get a kernel compiled for their filter
+  // size, input depth and stride, any other shape a generic one.
+  conv_direct_fn (*conv_direct_for)(const conv_layer_t* l);
+
+  // Winograd input transform (see winograd.h) of the 6x6 tile of depth
+  // channels at src, whose rows are stride apart. Element e of B^T d B is
+  // written to v + e * vs. tmp is scratch space of 36 * depth values.
+  void (*winograd_input)(const real_t* src, int stride, int depth, real_t* tmp, real_t* v, int vs);
+
+  // Multiplies the 36 matrices of transformed tiles (tiles x depth each, tiles
+  // a multiple of GEMM_MR, element e at v + e * tiles * depth) with the
+  // transformed filters of the layer, writing element e to m + e * tiles * ldb.
+  void (*winograd_gemm)(conv_layer_t* l, const real_t* v, int tiles, real_t* m);
+
+  // Winograd output transform: A^T M A of the 6x6 tile of n channels whose
+  // element e is at m + e * ms, written as 4 rows of ldb values to y. at is
+  // scratch space of 12 * ldb values.
+  void (*winograd_output)(const real_t* m, int ms, int ldb, int n, real_t* at, real_t* y);
+
+  // Full precision fc_forward and softmax_forward.
+  void (*fc)(fc_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+  void (*softmax)(softmax_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+
+  // Multiplies the first rows rows of an int8 panel (zero padded up to a
+  // multiple of QUANT_MR rows) with the quantized weights and writes the
+  // dequantized result plus bias of row i to dst[i][0 .. num_outputs).
+  void (*quant_gemm)(quant_t* q, const uint8_t* panel, int rows, real_t** dst, const real_t* bias);
+
+  // Runs iterations rounds of independent vector multiply-adds, as many as
+  // keep the arithmetic units busy, writes a result to sink and returns the
+  // flops done: a measure of this variant's peak compute rate.
+  double (*peak_fma)(long iterations, real_t* sink);
+} kernels_t;
+
+// The variants, in increasing order of preference.
+extern const kernels_t kernels_scalar;
+extern const kernels_t kernels_sse4;
+extern const kernels_t kernels_avx2;
+extern const kernels_t kernels_avx512;
+
+// Returns the kernels selected for this CPU.
+const kernels_t* kernels();
+
+#endif
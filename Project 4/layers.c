@@ -2,6 +2,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Include SSE intrinsics
 #if defined(_MSC_VER)
@@ -14,8 +15,15 @@
 // Include OpenMP
 #include <omp.h>
 
+#include "kernels.h"
 #include "layers.h"
+#include "quant.h"
 #include "volume.h"
+#include "winograd.h"
+
+// Number of im2col rows (output pixels, across the whole batch) lowered at
+// once. With the largest filter (5x5x20) a block stays within L2.
+#define CONV_MC 64
 
 conv_layer_t* make_conv_layer(int input_width, int input_height, int input_depth, int filter_width, int num_filters, int stride, int pad)
 {
@@ -43,9 +51,132 @@ conv_layer_t* make_conv_layer(int input_width, int input_height, int input_depth
   l->bias   = 0.0;
   l->biases = make_volume(1, 1, l->output_depth, l->bias);
 
+  l->num_weights  = l->filter_width * l->filter_height * l->input_depth;
+  l->packed_depth = (num_filters + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+  l->packed = _mm_malloc(sizeof(real_t) * l->num_weights * l->packed_depth, 64);
+  for (int k = 0; k < l->num_weights * l->packed_depth; k++)
+  {
+    l->packed[k] = 0.0;
+  }
+
+  l->quant = NULL;
+
+  l->algo = CONV_ALGO_GEMM;
+  l->winograd = NULL;
+  l->direct = NULL;
+  if (winograd_supported(l))
+  {
+    l->winograd = _mm_malloc(sizeof(real_t) * 36 * l->input_depth * l->packed_depth, 64);
+    memset(l->winograd, 0, sizeof(real_t) * 36 * l->input_depth * l->packed_depth);
+  }
+
   return l;
 }
 
+void free_conv_layer(conv_layer_t* l)
+{
+  for (int f = 0; f < l->output_depth; f++)
+  {
+    free_volume(l->filters[f]);
+  }
+  free(l->filters);
+  free_volume(l->biases);
+  _mm_free(l->packed);
+  free_quant(l->quant);
+  _mm_free(l->winograd);
+  free(l);
+}
+
+int conv_set_algo(conv_layer_t* l, conv_algo_t algo)
+{
+  if (algo == CONV_ALGO_WINOGRAD && !winograd_supported(l))
+  {
+    return 0;
+  }
+  // A register tile of the direct kernel must not straddle two output rows.
+  if (algo == CONV_ALGO_DIRECT && l->output_width % GEMM_MR != 0)
+  {
+    return 0;
+  }
+  l->algo = algo;
+  if (algo == CONV_ALGO_DIRECT)
+  {
+    l->direct = kernels()->conv_direct_for(l);
+  }
+  return 1;
+}
+
+// Lowers rows [row, row + rows) of the im2col matrix of the batch into panel.
+// Row r corresponds to output pixel (r % pixels) of image (start + r / pixels)
+// and holds the filter_height * filter_width * input_depth input values that
+// pixel's filters are multiplied with, in the same order as the filter weights.
+// Taps that fall into the padding are written as zeros; when the input carries
+// a halo at least as wide as the padding they are read from it instead, and
+// each filter row is a single copy.
+static void conv_im2col(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, real_t* panel)
+{
+  int pixels = l->output_width * l->output_height;
+  int depth = l->input_depth;
+  int fw = l->filter_width;
+  int fh = l->filter_height;
+
+  for (int r = 0; r < rows; r++, row++)
+  {
+    volume_t* in = inputs[start + row / pixels];
+    int pixel = row % pixels;
+    int y = (pixel / l->output_width) * l->stride - l->pad;
+    int x = (pixel % l->output_width) * l->stride - l->pad;
+
+    real_t* dst = panel + r * l->num_weights;
+    if (in->pad >= l->pad)
+    {
+      for (int fy = 0; fy < fh; fy++, dst += fw * depth)
+      {
+        memcpy(dst, &in->weights[volume_offset(in, x, y + fy, 0)], sizeof(real_t) * fw * depth);
+      }
+      continue;
+    }
+
+    // Horizontal filter range that overlaps the input, same for every fy
+    int fx_lo = (x < 0) ? -x : 0;
+    int fx_hi = (x + fw > in->width) ? in->width - x : fw;
+
+    for (int fy = 0; fy < fh; fy++, dst += fw * depth)
+    {
+      int in_y = y + fy;
+      if (in_y < 0 || in_y >= in->height)
+      {
+        memset(dst, 0, sizeof(real_t) * fw * depth);
+        continue;
+      }
+      memset(dst, 0, sizeof(real_t) * fx_lo * depth);
+      memcpy(dst + fx_lo * depth, &in->weights[volume_offset(in, x + fx_lo, in_y, 0)],
+             sizeof(real_t) * (fx_hi - fx_lo) * depth);
+      memset(dst + fx_hi * depth, 0, sizeof(real_t) * (fw - fx_hi) * depth);
+    }
+  }
+}
+
+// Computes rows [row, row + rows) of the im2col product (rows <= CONV_MC) and
+// writes the output_depth results of row i, bias included, to dst[i]. panel
+// is scratch space for CONV_MC im2col rows.
+static void conv_gemm_rows(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, real_t* panel, real_t** dst)
+{
+  int k_len = l->num_weights;
+  int tiled = (rows + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+
+  conv_im2col(l, inputs, start, row, rows, panel);
+  memset(panel + rows * k_len, 0, sizeof(real_t) * (tiled - rows) * k_len);
+  kernels()->conv_gemm(l, panel, rows, dst);
+}
+
+// Whether conv_forward runs the direct kernel on a batch: the layer has to be
+// set to it and the inputs have to carry a halo covering the padding.
+static int conv_use_direct(conv_layer_t* l, volume_t** inputs, int start)
+{
+  return l->algo == CONV_ALGO_DIRECT && inputs[start]->pad >= l->pad;
+}
+
 // Performs the forward pass for a convolutional layer by convolving each one
 // of the filters with a particular input, and placing the result in the output
 // array.
@@ -82,138 +213,67 @@ conv_layer_t* make_conv_layer(int input_width, int input_height, int input_depth
 // arrays, we must use the volume_get and volume_set commands to access elements
 // at a coordinate (x, y, d). Finally, we add the corresponding bias for the
 // filter to the sum before putting it into the output volume.
+//
+// The whole batch [start, end] is computed as one matrix product: the output
+// pixels of all images are lowered into an im2col panel (one row per pixel,
+// CONV_MC rows at a time) which is multiplied with the packed filter matrix, so
+// every filter is streamed from cache once per block instead of once per image.
 void conv_forward(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
 {
-  int stride = l->stride;                     //create these variables before hand so that they don't have to be calculated each time
-  int depth = l->output_depth;
-  int height = l->output_height;
-  int width = l->output_width;
+  if (l->quant != NULL)
+  {
+    conv_forward_q8(l, inputs, outputs, start, end);
+    return;
+  }
+  if (l->algo == CONV_ALGO_WINOGRAD)
+  {
+    conv_forward_winograd(l, inputs, outputs, start, end);
+    return;
+  }
 
+  int pixels = l->output_width * l->output_height;
+  int total = pixels * (end - start + 1);
+  int direct = conv_use_direct(l, inputs, start);
 
-    volume_t* in  = inputs[0];
-    volume_t* out = outputs[0];
-    int in_width = in->width;                 //don't need to be evaluated each time the loop runs
-    int in_height = in->height;
-    for (int f = 0; f < depth; f++)             ///put this here Instead because to preseve spatial locality
-    {
-      volume_t* filter = l->filters[f];
-      int filter_height = filter->height;     //don't need to be evaluated each time the loop runs
-      int filter_width = filter->width;
-      int filter_depth = filter->depth;
+  real_t* panel = direct ? NULL : _mm_malloc(sizeof(real_t) * CONV_MC * l->num_weights, 32);
+  real_t* dst[CONV_MC];
 
-      int y = -l->pad;
-      for (int out_y = 0; out_y < height; y += stride, out_y++)
-      {
-        int x = -l->pad;
-        for (int out_x = 0; out_x < width; x += stride, out_x++)
-        {
-          // Take sum of element-wise product
-          double sum = 0.0;
-          int fy;
-          if (y < 0.0)
-          {
-            fy = -1*y;
-          }
-          else
-          {
-            fy = 0;
-          }
-          for (; fy < filter_height; fy++)
-          {
-            int in_y = y + fy;
-            int fx;
-            if (x < 0.0)
-            {
-              fx = -1*x;
-            }
-            else
-            {
-              fx = 0;
-            }
-            for (; fx < filter_width; fx++)
-            {
-              int in_x = x + fx;
+  for (int row = 0; row < total; row += CONV_MC)
+  {
+    int rows = (total - row < CONV_MC) ? total - row : CONV_MC;
+    for (int i = 0; i < rows; i++)
+    {
+      volume_t* out = outputs[start + (row + i) / pixels];
+      int pixel = (row + i) % pixels;
+      dst[i] = &out->weights[volume_offset(out, pixel % l->output_width, pixel / l->output_width, 0)];
+    }
+    if (direct)
+    {
+      l->direct(l, inputs, start, row, rows, dst);
+    }
+    else
+    {
+      conv_gemm_rows(l, inputs, start, row, rows, panel, dst);
+    }
+  }
 
-              if (in_y >= 0 && in_y < in_height && in_x >= 0 && in_x < in_width)
-              {
-                if (filter_depth == 3)
-                {
-                  sum += filter->weights[((filter->width * fy) + fx) * filter->depth] * in->weights[((in->width * in_y) + in_x) * in->depth];
-                  sum += filter->weights[((filter->width * fy) + fx) * filter->depth + 1] * in->weights[((in->width * in_y) + in_x) * in->depth + 1];
-                  sum += filter->weights[((filter->width * fy) + fx) * filter->depth + 2] * in->weights[((in->width * in_y) + in_x) * in->depth + 2];
-                }
-                else if (filter_depth == 16)
-                {
-                  __m256d simdSum = _mm256_set1_pd(0.0);
-                  __m256d temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth]);
-                  __m256d temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 4]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 4]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 8]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 8]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 12]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 12]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  double p[4];
-                  _mm256_storeu_pd(p, simdSum);
-
-                  sum = (sum + p[0] + p[1] + p[2] + p[3]);
-                }
+  _mm_free(panel);
+}
 
-                else
-                {
-                  __m256d simdSum = _mm256_set1_pd(0.0);
-                  __m256d temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth]);
-                  __m256d temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 4]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 4]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 8]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 8]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 12]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 12]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  temp1 = _mm256_loadu_pd (&filter->weights[((filter->width * fy) + fx) * filter->depth + 16]);
-                  temp2 = _mm256_loadu_pd (&in->weights[((in->width * in_y) + in_x) * in->depth + 16]);
-                  temp1 = _mm256_mul_pd (temp2, temp1);
-                  simdSum = _mm256_add_pd (simdSum, temp1);
-
-                  double p[4];
-                  _mm256_storeu_pd(p, simdSum);
-
-                  sum = (sum + p[0] + p[1] + p[2] + p[3]);
-                }
-              }
-            }
-          }
-          sum += l->biases->weights[f];
-          //volume_set(out, out_x, out_y, f, sum);
-          out->weights[((out->width * out_y) + out_x) * out->depth + f] = sum;
-        }
-      }
+// Copies the filters into the blocked layout consumed by the GEMM and direct
+// kernels: filters are grouped into blocks of GEMM_NR, and row k of a block
+// holds weight k of its filters, so each block is streamed front to back and
+// a row is one pair of aligned loads.
+static void conv_pack_filters(conv_layer_t* l)
+{
+  for (int f = 0; f < l->output_depth; f++)
+  {
+    real_t* block = l->packed + (f / GEMM_NR) * GEMM_NR * l->num_weights;
+    for (int k = 0; k < l->num_weights; k++)
+    {
+      block[k * GEMM_NR + f % GEMM_NR] = l->filters[f]->weights[k];
     }
-
+  }
 }
 
 void conv_load(conv_layer_t* l, const char* file_name)
@@ -257,6 +317,12 @@ void conv_load(conv_layer_t* l, const char* file_name)
   }
 
   fclose(fin);
+
+  conv_pack_filters(l);
+  if (l->winograd != NULL)
+  {
+    winograd_transform_filters(l);
+  }
 }
 
 relu_layer_t* make_relu_layer(int input_width, int input_height, int input_depth)
@@ -284,6 +350,11 @@ void relu_forward(relu_layer_t* l, volume_t** inputs, volume_t** outputs, int st
 
 //  printf("relu_load depth is: %d ", input_depth);
 
+  for (int i = start; i <= end; i++)
+  {
+    volume_t* in  = inputs[i];
+    volume_t* out = outputs[i];
+
     for (int x = 0; x < input_width; x++)                   //loop ordering somehow does not work here
     {
       for (int y = 0; y < input_height; y++)
@@ -291,12 +362,13 @@ void relu_forward(relu_layer_t* l, volume_t** inputs, volume_t** outputs, int st
         for (int d = 0; d < input_depth; d++)
         {
           //double value = (volume_get(inputs[i], x, y, d) < 0.0) ? 0.0 : volume_get(inputs[i], x, y, d);
-          double value = (inputs[0]->weights[((inputs[0]->width * y) + x) * inputs[0]->depth + d] < 0.0) ? 0.0 : inputs[0]->weights[((inputs[0]->width * y) + x) * inputs[0]->depth + d];
+          real_t value = (in->weights[volume_offset(in, x, y, d)] < 0.0) ? 0.0 : in->weights[volume_offset(in, x, y, d)];
           //volume_set(outputs[i], x, y, d, value);
-          outputs[0]->weights[((outputs[0]->width * y) + x) * outputs[0]->depth + d] = value;
+          out->weights[volume_offset(out, x, y, d)] = value;
         }
       }
     }
+  }
 
 }
 
@@ -341,15 +413,13 @@ void pool_forward(pool_layer_t* l, volume_t** inputs, volume_t** outputs, int st
   int pool_width = l->pool_width;
   int pool_height = l->pool_height;
 
-
-    volume_t* in  = inputs[0];
-    volume_t* out = outputs[0];
+  for (int i = start; i <= end; i++)
+  {
+    volume_t* in  = inputs[i];
+    volume_t* out = outputs[i];
 
     int in_width = in->width;
     int in_height = in->height;
-    int in_depth = in->depth;
-    int out_width = out->width;
-    int out_depth = out->depth;
 
     int n = 0;
 
@@ -361,7 +431,7 @@ void pool_forward(pool_layer_t* l, volume_t** inputs, volume_t** outputs, int st
         int y = -l->pad;
         for (int out_y = 0; out_y < output_height; y += stride, out_y++)
         {
-          double max = -INFINITY;
+          real_t max = -INFINITY;
           for (int fx = 0; fx < pool_width; fx++)
           {
             for (int fy = 0; fy < pool_height; fy++)
@@ -371,7 +441,7 @@ void pool_forward(pool_layer_t* l, volume_t** inputs, volume_t** outputs, int st
               if (in_x >= 0 && in_x < in_width && in_y >= 0 && in_y < in_height)
               {
                 //double v = volume_get(in, in_x, in_y, d);
-                double v = in->weights[((in_width * in_y) + in_x) * in_depth + d];
+                real_t v = in->weights[volume_offset(in, in_x, in_y, d)];
                 if (v > max)
                 {
                   max = v;
@@ -382,13 +452,106 @@ void pool_forward(pool_layer_t* l, volume_t** inputs, volume_t** outputs, int st
 
           n++;
           //volume_set(out, out_x, out_y, d, max);
-          out->weights[((out_width * out_y) + out_x) * out_depth + d] = max;
+          out->weights[volume_offset(out, out_x, out_y, d)] = max;
         }
       }
     }
+  }
 
 }
 
+int conv_relu_pool_supported(conv_layer_t* c, pool_layer_t* p)
+{
+  return p->input_width == c->output_width && p->input_height == c->output_height &&
+         p->input_depth == c->output_depth && p->stride == p->pool_width && p->stride == p->pool_height &&
+         p->pad == 0;
+}
+
+// Since max and ReLU commute, each window is reduced to its maximum first and
+// the ReLU is applied once per pooled value.
+void conv_relu_pool_forward(conv_layer_t* c, relu_layer_t* r, pool_layer_t* p, volume_t** inputs, volume_t** outputs,
+                            int start, int end)
+{
+  assert(conv_relu_pool_supported(c, p));
+
+  if (c->quant == NULL && c->algo == CONV_ALGO_WINOGRAD && winograd_pool_supported(p))
+  {
+    conv_relu_pool_forward_winograd(c, inputs, outputs, start, end);
+    return;
+  }
+
+  int pixels = c->output_width * c->output_height;
+  int depth = c->output_depth;
+  int band = p->pool_height * c->output_width;
+  int direct = conv_use_direct(c, inputs, start);
+
+  // Conv output under one row of pool windows
+  real_t* tile = _mm_malloc(sizeof(real_t) * band * depth, 32);
+  real_t* dst[CONV_MC];
+  real_t* panel = NULL;
+  uint8_t* panel_q8 = NULL;
+  if (c->quant != NULL)
+  {
+    panel_q8 = _mm_malloc(QUANT_MC * c->quant->padded_inputs, 32);
+  }
+  else if (!direct)
+  {
+    panel = _mm_malloc(sizeof(real_t) * CONV_MC * c->num_weights, 32);
+  }
+  int chunk = (c->quant != NULL && QUANT_MC < CONV_MC) ? QUANT_MC : CONV_MC;
+
+  for (int i = start; i <= end; i++)
+  {
+    volume_t* out = outputs[i];
+    for (int py = 0; py < p->output_height; py++)
+    {
+      int row = (i - start) * pixels + py * p->stride * c->output_width;
+      for (int k = 0; k < band; k += chunk)
+      {
+        int rows = (band - k < chunk) ? band - k : chunk;
+        for (int j = 0; j < rows; j++)
+        {
+          dst[j] = tile + (k + j) * depth;
+        }
+        if (c->quant != NULL)
+        {
+          conv_rows_q8(c, inputs, start, row + k, rows, panel_q8, dst);
+        }
+        else if (direct)
+        {
+          c->direct(c, inputs, start, row + k, rows, dst);
+        }
+        else
+        {
+          conv_gemm_rows(c, inputs, start, row + k, rows, panel, dst);
+        }
+      }
+
+      for (int px = 0; px < p->output_width; px++)
+      {
+        real_t* o = &out->weights[volume_offset(out, px, py, 0)];
+        for (int f = 0; f < depth; f++)
+        {
+          real_t max = -INFINITY;
+          for (int fy = 0; fy < p->pool_height; fy++)
+          {
+            for (int fx = 0; fx < p->pool_width; fx++)
+            {
+              real_t v = tile[(fy * c->output_width + px * p->stride + fx) * depth + f];
+              max = (v > max) ? v : max;
+            }
+          }
+          o[f] = (max < 0.0) ? 0.0 : max;
+        }
+      }
+    }
+  }
+
+  _mm_free(tile);
+  _mm_free(panel);
+  _mm_free(panel_q8);
+}
+
 fc_layer_t* make_fc_layer(int input_width, int input_height, int input_depth, int num_neurons)
 {
   fc_layer_t* l = (fc_layer_t*)malloc(sizeof(fc_layer_t));
@@ -411,31 +574,27 @@ fc_layer_t* make_fc_layer(int input_width, int input_height, int input_depth, in
   l->bias   = 0.0;
   l->biases = make_volume(1, 1, l->output_depth, l->bias);
 
+  l->packed = _mm_malloc(sizeof(real_t) * l->num_inputs * l->output_depth, 64);
+  memset(l->packed, 0, sizeof(real_t) * l->num_inputs * l->output_depth);
+
+  l->quant = NULL;
+
   return l;
 }
 
 // Computes the dot product (i.e. the sum of the elementwise product) of the
 // input's weights with each of the filters. Note that these filters are not
-// the same as the filters for the convolutional layer.
+// the same as the filters for the convolutional layer. The batch is one GEMM
+// of the inputs with the packed filters (see kernels.c).
 void fc_forward(fc_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
 {
+  if (l->quant != NULL)
+  {
+    fc_forward_q8(l, inputs, outputs, start, end);
+    return;
+  }
 
-
-      volume_t* in  = inputs[0];
-      volume_t* out = outputs[0];
-
-      for (int i = 0; i < l->output_depth; i++)
-      {
-        double dot = 0.0;
-
-        for (int d = 0; d < l->num_inputs; d++)
-        {
-          dot += in->weights[d] * l->filters[i]->weights[d];
-        }
-        dot += l->biases->weights[i];
-        out->weights[i] = dot;
-      }
-
+  kernels()->fc(l, inputs, outputs, start, end);
 }
 
 void fc_load(fc_layer_t* l, const char* filename)
@@ -452,16 +611,25 @@ void fc_load(fc_layer_t* l, const char* filename)
   {
     for (int j = 0; j < l->num_inputs; j++)
     {
-      fscanf(fin, "%lf", &(l->filters[i]->weights[j]));
+      double val;
+      fscanf(fin, "%lf", &val);
+      l->filters[i]->weights[j] = val;
     }
   }
 
   for (int i = 0; i < l->output_depth; i++)
   {
-    fscanf(fin, "%lf", &(l->biases->weights[i]));
+    double val;
+    fscanf(fin, "%lf", &val);
+    l->biases->weights[i] = val;
   }
 
   fclose(fin);
+
+  for (int f = 0; f < l->output_depth; f++)
+  {
+    memcpy(l->packed + f * l->num_inputs, l->filters[f]->weights, sizeof(real_t) * l->num_inputs);
+  }
 }
 
 softmax_layer_t* make_softmax_layer(int input_width, int input_height, int input_depth)
@@ -476,7 +644,7 @@ softmax_layer_t* make_softmax_layer(int input_width, int input_height, int input
   l->output_height = 1;
   l->output_depth  = l->input_width * l->input_height * l->input_depth;
 
-  l->likelihoods = (double*)malloc(sizeof(double) * l->output_depth);
+  l->likelihoods = (real_t*)malloc(sizeof(real_t) * l->output_depth);
 
   return l;
 }
@@ -492,47 +660,5 @@ softmax_layer_t* make_softmax_layer(int input_width, int input_height, int input
 // but is more resilient to floating point errors.
 void softmax_forward(softmax_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
 {
-  double likelihoods[l->output_depth];
-
-  volume_t* in  = inputs[0];
-  volume_t* out = outputs[0];
-
-  // Compute max activation (used to compute exponentials)
-  double amax = in->weights[0];
-  double* in_weights = in->weights;
-  for (int i = 1; i < l->output_depth; i++)
-  {
-    if (in_weights[i] > amax)
-    {
-      amax = in_weights[i];
-    }
-  }
-  // Compute exponentials in a numerically stable way
-  double total = 0.0;
-
-  for (int i = 0; i < l->output_depth; i++)
-  {
-    double e = exp(in_weights[i] - amax);
-    total += e;
-    likelihoods[i] = e;
-  }
-
-  // Normalize and output to sum to one
-  double* out_weights = out->weights;
-  // for (int i = 0; i < l->output_depth; i++)
-  // {
-  //   out_weights[i] = likelihoods[i] / total;
-  // }
-
-  __m256d div = _mm256_loadu_pd(likelihoods);
-  __m256d simtotal = _mm256_set1_pd(total);
-  div = _mm256_div_pd(div, simtotal);
-  _mm256_storeu_pd(out_weights, div);
-
-  div = _mm256_loadu_pd(likelihoods + 4);
-  div = _mm256_div_pd(div, simtotal);
-  _mm256_storeu_pd(out_weights + 4, div);
-
-  out_weights[8] = likelihoods[8] / total;
-  out_weights[9] = likelihoods[9] / total;
+  kernels()->softmax(l, inputs, outputs, start, end);
 }
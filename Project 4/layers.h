@@ -5,6 +5,8 @@
 
 #include "volume.h"
 
+struct quant;
+
 // What follows are the different layers of the CNN. You will not have to
 // understand what these layers are actually doing. In general, each layer has
 // the following operations:
@@ -18,6 +20,26 @@
 // NOTE: You will only have to make changes to the *_forward functions for each
 // layer.
 
+// Register tile of the conv kernels (see kernels.h): GEMM_MR output pixels by
+// GEMM_NR output channels. GEMM_NR is one 64 byte cache line of real_t, which
+// every kernel variant covers with a whole number of vector registers, so the
+// packed filters are laid out the same whichever variant runs them.
+#define GEMM_MR 4
+#define GEMM_NR ((int)(64 / sizeof(real_t)))
+
+// Algorithms conv_forward can use for a convolutional layer.
+typedef enum conv_algo {
+  CONV_ALGO_GEMM,      // im2col + blocked GEMM, any filter shape
+  CONV_ALGO_WINOGRAD,  // Winograd F(2x2, 5x5), 5x5 filters with stride 1 only
+  CONV_ALGO_DIRECT,    // Direct register-blocked kernel over inputs with a halo,
+                       // output widths that are a multiple of GEMM_MR only
+} conv_algo_t;
+
+struct conv_layer;
+
+// Direct conv kernel (see kernels.h) for one layer shape.
+typedef void (*conv_direct_fn)(struct conv_layer* l, volume_t** inputs, int start, int row, int rows, real_t** dst);
+
 // Convolutional Layer Parameters
 typedef struct conv_layer {
   // Required
@@ -33,15 +55,41 @@ typedef struct conv_layer {
   // Computed
   int output_width;
   int output_height;
-  double bias;
+  real_t bias;
   volume_t* biases;
   volume_t** filters;
+
+  // Filters packed in blocks of GEMM_NR output channels (zero padded up to
+  // packed_depth), each a (filter_width * filter_height * input_depth) x
+  // GEMM_NR matrix with one column per filter. Filled in by conv_load.
+  int num_weights;
+  int packed_depth;
+  real_t* packed;
+
+  // Int8 weights and scales (see quant.h). When set, conv_forward runs the
+  // quantized kernel instead.
+  struct quant* quant;
+
+  // Algorithm used by conv_forward, and the Winograd transformed filters (see
+  // winograd.h) when the layer's shape supports it, NULL otherwise.
+  conv_algo_t algo;
+  real_t* winograd;
+
+  // Direct kernel for the layer's shape, picked by conv_set_algo.
+  conv_direct_fn direct;
 } conv_layer_t;
 
 // Creates a convolutional layer with the following parameters.
 conv_layer_t* make_conv_layer(int input_width, int input_height, int input_depth, int filter_width, int num_filters,
                               int stride, int pad);
 
+// Frees a convolutional layer together with its filters and biases.
+void free_conv_layer(conv_layer_t* l);
+
+// Selects the algorithm conv_forward uses for the layer. Returns 0 (and keeps
+// the current one) if the layer's shape does not support it.
+int conv_set_algo(conv_layer_t* l, conv_algo_t algo);
+
 // Computes the forward pass for a convolutional layer on the relevant inputs
 // and stores the result into the relevant outputs.
 void conv_forward(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
@@ -94,6 +142,18 @@ pool_layer_t* make_pool_layer(int input_width, int input_height, int input_depth
 // stores the result into the relevant outputs.
 void pool_forward(pool_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
 
+// Returns whether conv_relu_pool_forward can fuse the given conv and pool
+// layers: the pool has to read the conv output and use non-overlapping,
+// unpadded windows.
+int conv_relu_pool_supported(conv_layer_t* c, pool_layer_t* p);
+
+// Computes pool(relu(conv(input))) for the relevant inputs and stores the
+// result into the pool layer's outputs. The conv output is produced one band
+// of pool windows at a time in a small buffer, and neither the conv nor the
+// ReLU volume is ever written.
+void conv_relu_pool_forward(conv_layer_t* c, relu_layer_t* r, pool_layer_t* p, volume_t** inputs, volume_t** outputs,
+                            int start, int end);
+
 // FC Layer Parameters
 typedef struct fc_layer {
   // Required
@@ -106,9 +166,17 @@ typedef struct fc_layer {
   int output_width;
   int output_height;
   int num_inputs;
-  double bias;
+  real_t bias;
   volume_t* biases;
   volume_t** filters;
+
+  // The filters as one output_depth x num_inputs matrix, one filter per row.
+  // Filled in by fc_load.
+  real_t* packed;
+
+  // Int8 weights and scales (see quant.h). When set, fc_forward runs the
+  // quantized kernel instead.
+  struct quant* quant;
 } fc_layer_t;
 
 // Creates a fully-connected layer with the following parameters.
@@ -127,7 +195,7 @@ typedef struct softmax_layer {
   int input_depth;
   int input_width;
   int input_height;
-  double* likelihoods;
+  real_t* likelihoods;
 
   // Computed
   int output_depth;
@@ -1,4 +1,11 @@
+// MAP_ANONYMOUS, MADV_HUGEPAGE
+#define _DEFAULT_SOURCE
+
+#include <assert.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
 // Include SSE intrinsics
 #if defined(_MSC_VER)
@@ -13,14 +20,68 @@
 
 #include "layers.h"
 #include "network.h"
+#include "profile.h"
+#include "quant.h"
+#include "snapshot.h"
 #include "volume.h"
 
+// Applies a per-layer convolution algorithm override of the form
+// "l0=direct,l3=winograd,l6=gemm" (taken from the CONV_ALGO environment
+// variable). Layers that are not mentioned keep their default.
+static void set_conv_algos(network_t* net, const char* spec)
+{
+  char buf[256];
+  strncpy(buf, spec, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+
+  for (char* item = strtok(buf, ","); item != NULL; item = strtok(NULL, ","))
+  {
+    char* eq = strchr(item, '=');
+    if (eq == NULL)
+    {
+      fprintf(stderr, "CONV_ALGO: ignoring '%s'\n", item);
+      continue;
+    }
+    *eq = '\0';
+
+    conv_layer_t* l = NULL;
+    if (!strcmp(item, "l0")) l = net->l0;
+    if (!strcmp(item, "l3")) l = net->l3;
+    if (!strcmp(item, "l6")) l = net->l6;
+
+    conv_algo_t algo;
+    if (!strcmp(eq + 1, "gemm"))
+    {
+      algo = CONV_ALGO_GEMM;
+    }
+    else if (!strcmp(eq + 1, "winograd"))
+    {
+      algo = CONV_ALGO_WINOGRAD;
+    }
+    else if (!strcmp(eq + 1, "direct"))
+    {
+      algo = CONV_ALGO_DIRECT;
+    }
+    else
+    {
+      l = NULL;
+    }
+
+    if (l == NULL || !conv_set_algo(l, algo))
+    {
+      fprintf(stderr, "CONV_ALGO: ignoring '%s=%s'\n", item, eq + 1);
+    }
+  }
+}
+
 network_t* make_network()
 {
   network_t* net = (network_t*)malloc(sizeof(network_t));
 
-  net->layers[0] = make_volume(32, 32, 3, 0.0);
+  // The inputs of the conv layers carry a halo as wide as the layer's padding
+  // (see volume.h), which the layers before them write around.
   net->l0        = make_conv_layer(32, 32, 3, 5, 16, 1, 2);
+  net->layers[0] = make_padded_volume(32, 32, 3, net->l0->pad);
 
   net->layers[1] = make_volume(net->l0->output_width, net->l0->output_height, net->l0->output_depth, 0.0);
   net->l1        = make_relu_layer(net->layers[1]->width, net->layers[1]->height, net->layers[1]->depth);
@@ -28,8 +89,8 @@ network_t* make_network()
   net->layers[2] = make_volume(net->l1->output_width, net->l1->output_height, net->l1->output_depth, 0.0);
   net->l2        = make_pool_layer(net->layers[2]->width, net->layers[2]->height, net->layers[2]->depth, 2, 2);
 
-  net->layers[3] = make_volume(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 0.0);
-  net->l3        = make_conv_layer(net->layers[3]->width, net->layers[3]->height, net->layers[3]->depth, 5, 20, 1, 2);
+  net->l3        = make_conv_layer(net->l2->output_width, net->l2->output_height, net->l2->output_depth, 5, 20, 1, 2);
+  net->layers[3] = make_padded_volume(net->l3->input_width, net->l3->input_height, net->l3->input_depth, net->l3->pad);
 
   net->layers[4] = make_volume(net->l3->output_width, net->l3->output_height, net->l3->output_depth, 0.0);
   net->l4        = make_relu_layer(net->layers[4]->width, net->layers[4]->height, net->layers[4]->depth);
@@ -37,8 +98,8 @@ network_t* make_network()
   net->layers[5] = make_volume(net->l4->output_width, net->l4->output_height, net->l4->output_depth, 0.0);
   net->l5        = make_pool_layer(net->layers[5]->width, net->layers[5]->height, net->layers[5]->depth, 2, 2);
 
-  net->layers[6] = make_volume(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 0.0);
-  net->l6        = make_conv_layer(net->layers[6]->width, net->layers[6]->height, net->layers[6]->depth, 5, 20, 1, 2);
+  net->l6        = make_conv_layer(net->l5->output_width, net->l5->output_height, net->l5->output_depth, 5, 20, 1, 2);
+  net->layers[6] = make_padded_volume(net->l6->input_width, net->l6->input_height, net->l6->input_depth, net->l6->pad);
 
   net->layers[7] = make_volume(net->l6->output_width, net->l6->output_height, net->l6->output_depth, 0.0);
   net->l7        = make_relu_layer(net->layers[7]->width, net->layers[7]->height, net->layers[7]->depth);
@@ -53,11 +114,49 @@ network_t* make_network()
   net->l10        = make_softmax_layer(net->layers[10]->width, net->layers[10]->height, net->layers[10]->depth);
 
   net->layers[11] = make_volume(net->l10->output_width, net->l10->output_height, net->l10->output_depth, 0.0);
+
+  net->fused = conv_relu_pool_supported(net->l0, net->l2) && conv_relu_pool_supported(net->l3, net->l5) &&
+               conv_relu_pool_supported(net->l6, net->l8);
+
+  net->batch_size = NET_DEFAULT_BATCH;
+  const char* batch_size = getenv("NET_BATCH");
+  if (batch_size != NULL)
+  {
+    net->batch_size = atoi(batch_size);
+    if (net->batch_size < 1)
+    {
+      fprintf(stderr, "NET_BATCH: ignoring '%s'\n", batch_size);
+      net->batch_size = NET_DEFAULT_BATCH;
+    }
+  }
+
+  net->snapshot      = NULL;
+  net->snapshot_size = 0;
+  net->profile       = NULL;
+
+  // Winograd only pays off once there are enough input channels to amortize
+  // the input transform. l0 (3 channels) runs the direct kernel, which skips
+  // the im2col copy that dominates such a thin layer.
+  conv_set_algo(net->l0, CONV_ALGO_DIRECT);
+  conv_set_algo(net->l3, CONV_ALGO_WINOGRAD);
+  conv_set_algo(net->l6, CONV_ALGO_WINOGRAD);
+
+  const char* algos = getenv("CONV_ALGO");
+  if (algos != NULL)
+  {
+    set_conv_algos(net, algos);
+  }
   return net;
 }
 
 void free_network(network_t* net)
 {
+  // Mapped weights are views, which leaves only the volumes to free below.
+  if (net->snapshot != NULL)
+  {
+    snapshot_unmap(net);
+  }
+
   #pragma omp parallel
   {
       #pragma omp for
@@ -65,55 +164,34 @@ void free_network(network_t* net)
       {
         free_volume(net->layers[i]);
       }
-      // Free each conv layer's filters and biases
-      #pragma omp for
-      for (int f = 0; f < net->l0->output_depth; f++)
-      {
-        free_volume(net->l0->filters[f]);
-      }
-      #pragma omp for
-      for (int f = 0; f < net->l3->output_depth; f++)
-      {
-        free_volume(net->l3->filters[f]);
-      }
-      #pragma omp for
-      for (int f = 0; f < net->l6->output_depth; f++)
-      {
-        free_volume(net->l6->filters[f]);
-      }
+      // Free FC layer filters
       #pragma omp for
       for (int f = 0; f < net->l9->output_depth; f++)
       {
         free_volume(net->l9->filters[f]);
       }
   }
-  free(net->l0->filters);
-  free_volume(net->l0->biases);
-
-
-  free(net->l3->filters);
-  free_volume(net->l3->biases);
 
-
-  free(net->l6->filters);
-  free_volume(net->l6->biases);
+  // Free each conv layer's filters and biases
+  free_conv_layer(net->l0);
+  free_conv_layer(net->l3);
+  free_conv_layer(net->l6);
 
   // Free FC layer filters and biases
 
 
   free(net->l9->filters);
   free_volume(net->l9->biases);
+  _mm_free(net->l9->packed);
+  free_quant(net->l9->quant);
 
   // Free softmax layer likelihoods
   free(net->l10->likelihoods);
 
-  free(net->l0);
   free(net->l1);
   free(net->l2);
-  free(net->l3);
   free(net->l4);
   free(net->l5);
-  free(net->l6);
   free(net->l7);
   free(net->l8);
   free(net->l9);
@@ -122,71 +200,263 @@ void free_network(network_t* net)
   free(net);
 }
 
-batch_t* make_batch(network_t* net, int size)
+// Each batch lives in one anonymous mapping: a batch_arena_t header, the
+// batch_t array, the volume pointer arrays, the volume structs and then the
+// weights of every volume. Fresh anonymous pages are zero, which gives the
+// halos of padded volumes their zeros for free.
+//
+// In an inference batch, layer i of image j instead uses slot j of buffer
+// i % 2. Each layer reads one buffer and writes the other, and every slot is
+// as large as the largest volume net_forward writes.
+typedef struct batch_arena {
+  size_t size;
+  int shared;
+} batch_arena_t;
+
+// Alignment of every part of a batch arena, and of the interior origin of
+// each volume (its weights pointer).
+#define BATCH_ALIGN 64
+
+// Arenas at least this large ask for transparent huge pages.
+#define BATCH_HUGEPAGE_MIN (2 << 20)
+
+static size_t batch_align(size_t n)
 {
-  batch_t* out = (batch_t*)malloc(sizeof(volume_t * *) * (NUM_LAYERS + 1));
-  #pragma omp parallel
+  return (n + BATCH_ALIGN - 1) / BATCH_ALIGN * BATCH_ALIGN;
+}
+
+// Bytes in front of the halo of a volume shaped like v that align its
+// interior origin.
+static size_t batch_lead(volume_t* v)
+{
+  size_t halo = sizeof(real_t) * -volume_offset(v, -v->pad, -v->pad, 0);
+  return (BATCH_ALIGN - halo % BATCH_ALIGN) % BATCH_ALIGN;
+}
+
+// Arena bytes of the weights of a volume shaped like v.
+static size_t batch_volume_size(volume_t* v)
+{
+  size_t cells = (size_t)(v->width + 2 * v->pad) * (v->height + 2 * v->pad);
+  return batch_align(batch_lead(v) + sizeof(real_t) * cells * v->depth);
+}
+
+// Whether net_forward writes layer i of a batch.
+static int batch_written(network_t* net, int i)
+{
+  return !net->fused || i % 3 == 0 || i > 8;
+}
+
+static batch_t* batch_alloc(network_t* net, int size, int shared)
+{
+  size_t header_size = batch_align(sizeof(batch_arena_t));
+  size_t layers_size = batch_align(sizeof(volume_t**) * (NUM_LAYERS + 1));
+  size_t ptrs_size   = batch_align(sizeof(volume_t*) * size);
+  size_t vols_size   = batch_align(sizeof(volume_t) * size);
+
+  size_t slot = 0;
+  for (int i = 0; i < NUM_LAYERS + 1; i++)
+  {
+    if (batch_written(net, i) && batch_volume_size(net->layers[i]) > slot)
+    {
+      slot = batch_volume_size(net->layers[i]);
+    }
+  }
+
+  size_t total = header_size + layers_size + (NUM_LAYERS + 1) * (ptrs_size + vols_size);
+  if (shared)
+  {
+    total += 2 * slot * size;
+  }
+  else
   {
-    #pragma omp for
     for (int i = 0; i < NUM_LAYERS + 1; i++)
     {
-      out[i] = (volume_t**)malloc(sizeof(volume_t*) * size);
-      for (int j = 0; j < size; j++)
+      total += batch_volume_size(net->layers[i]) * size;
+    }
+  }
+
+  char* arena = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(arena != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+  if (total >= BATCH_HUGEPAGE_MIN)
+  {
+    madvise(arena, total, MADV_HUGEPAGE);
+  }
+#endif
+  ((batch_arena_t*)arena)->size   = total;
+  ((batch_arena_t*)arena)->shared = shared;
+
+  batch_t* out = (batch_t*)(arena + header_size);
+  char* next = arena + header_size + layers_size;
+  char* buffers = next + (NUM_LAYERS + 1) * (ptrs_size + vols_size);
+  for (int i = 0; i < NUM_LAYERS + 1; i++)
+  {
+    volume_t* shape = net->layers[i];
+    volume_t* vols = (volume_t*)(next + ptrs_size);
+    char* weights = buffers;
+    size_t stride = batch_volume_size(shape);
+    if (shared)
+    {
+      weights = buffers + (i % 2) * slot * size;
+      stride = slot;
+    }
+
+    out[i] = (volume_t**)next;
+    for (int j = 0; j < size; j++)
+    {
+      volume_t* v = &vols[j];
+      v->width  = shape->width;
+      v->height = shape->height;
+      v->depth  = shape->depth;
+      v->pad    = shape->pad;
+
+      real_t* base = (real_t*)(weights + j * stride + batch_lead(shape));
+      v->weights = base - volume_offset(v, -v->pad, -v->pad, 0);
+      // Layers net_forward skips have no room in a shared slot.
+      if (shared && !batch_written(net, i))
       {
-        out[i][j] = make_volume(net->layers[i]->width, net->layers[i]->height, net->layers[i]->depth, 0.0);
+        v->weights = NULL;
       }
+      out[i][j] = v;
+    }
+    next += ptrs_size + vols_size;
+    if (!shared)
+    {
+      buffers += size * stride;
     }
   }
+
   return out;
 }
 
-void free_batch(batch_t* b, int size)
+batch_t* make_batch(network_t* net, int size)
 {
-  for (int i = 0; i < NUM_LAYERS + 1; i++)
+  return batch_alloc(net, size, 0);
+}
+
+batch_t* make_inference_batch(network_t* net, int size)
+{
+  return batch_alloc(net, size, 1);
+}
+
+// The halo of a padded volume of an inference batch holds whatever the layers
+// that used its slot before left there, so it is cleared before the volume is
+// written.
+static void batch_clear_halos(batch_t* b, int layer, int start, int end)
+{
+  batch_arena_t* arena = (batch_arena_t*)((char*)b - batch_align(sizeof(batch_arena_t)));
+  if (!arena->shared)
   {
-    for (int j = 0; j < size; j++)
-    {
-      free_volume(b[i][j]);
-    }
-    free(b[i]);
+    return;
+  }
+  for (int i = start; i <= end; i++)
+  {
+    volume_clear_halo(b[layer][i]);
   }
-  free(b);
 }
 
+void free_batch(batch_t* b, int size)
+{
+  char* arena = (char*)b - batch_align(sizeof(batch_arena_t));
+  munmap(arena, ((batch_arena_t*)arena)->size);
+}
+
+// With net->profile set, the time between two laps goes to the stage named in
+// the second one, halo clearing included.
 void net_forward(network_t* net, batch_t* b, int start, int end)
 {
+  net_profile_t* p = net->profile;
+  int images = end - start + 1;
+  uint64_t t = profile_start(p);
 
+  batch_clear_halos(b, 0, start, end);
+  if (net->fused)
+  {
+    batch_clear_halos(b, 3, start, end);
+    conv_relu_pool_forward(net->l0, net->l1, net->l2, b[0], b[3], start, end);
+    t = profile_lap(p, 0, images, t);
+    batch_clear_halos(b, 6, start, end);
+    conv_relu_pool_forward(net->l3, net->l4, net->l5, b[3], b[6], start, end);
+    t = profile_lap(p, 3, images, t);
+    conv_relu_pool_forward(net->l6, net->l7, net->l8, b[6], b[9], start, end);
+    t = profile_lap(p, 6, images, t);
+  }
+  else
+  {
     conv_forward(net->l0, b[0], b[1], start, end);
+    t = profile_lap(p, 0, images, t);
     relu_forward(net->l1, b[1], b[2], start, end);
+    t = profile_lap(p, 1, images, t);
+    batch_clear_halos(b, 3, start, end);
     pool_forward(net->l2, b[2], b[3], start, end);
+    t = profile_lap(p, 2, images, t);
     conv_forward(net->l3, b[3], b[4], start, end);
+    t = profile_lap(p, 3, images, t);
     relu_forward(net->l4, b[4], b[5], start, end);
+    t = profile_lap(p, 4, images, t);
+    batch_clear_halos(b, 6, start, end);
     pool_forward(net->l5, b[5], b[6], start, end);
+    t = profile_lap(p, 5, images, t);
     conv_forward(net->l6, b[6], b[7], start, end);
+    t = profile_lap(p, 6, images, t);
     relu_forward(net->l7, b[7], b[8], start, end);
+    t = profile_lap(p, 7, images, t);
     pool_forward(net->l8, b[8], b[9], start, end);
-    fc_forward(net->l9, b[9], b[10], start, end);
-    softmax_forward(net->l10, b[10], b[11], start, end);
-  
+    t = profile_lap(p, 8, images, t);
+  }
+  fc_forward(net->l9, b[9], b[10], start, end);
+  t = profile_lap(p, 9, images, t);
+  softmax_forward(net->l10, b[10], b[11], start, end);
+  profile_lap(p, 10, images, t);
 }
 
-void net_classify(network_t* net, volume_t** input, double** likelihoods, int n)
+void net_classify_fn(network_t* net, net_input_fn input, void* arg, double** likelihoods, int n)
 {
+  // Shrinks the chunks when there are too few images to give every thread a
+  // full one.
+  int threads = omp_get_max_threads();
+  int size    = net->batch_size;
+  if ((long)size * threads > n)
+  {
+    size = (n + threads - 1) / threads;
+  }
+  if (size < 1)
+  {
+    size = 1;
+  }
+  int chunks = (n + size - 1) / size;
+
   #pragma omp parallel
   {
-    batch_t* b = make_batch(net, 1);
-    #pragma omp for
-    for (int i = 0; i < n; i++)
+    batch_t* b = make_inference_batch(net, size);
+    #pragma omp for schedule(static)
+    for (int c = 0; c < chunks; c++)
     {
-      copy_volume(b[0][0], input[i]);
-      net_forward(net, b, 0, 0);
-      for (int j = 0; j < NUM_CLASSES; j++)
+      int first = c * size;
+      int count = (first + size <= n) ? size : n - first;
+      for (int i = 0; i < count; i++)
       {
-        likelihoods[i][j] = b[11][0]->weights[j];
+        input(arg, first + i, b[0][i]);
+      }
+      net_forward(net, b, 0, count - 1);
+      for (int i = 0; i < count; i++)
+      {
+        for (int j = 0; j < NUM_CLASSES; j++)
+        {
+          likelihoods[first + i][j] = b[11][i]->weights[j];
+        }
       }
     }
-    free_batch(b, 1);
+    free_batch(b, size);
   }
+}
 
+static void copy_input(void* input, int i, volume_t* v)
+{
+  copy_volume(v, ((volume_t**)input)[i]);
+}
 
+void net_classify(network_t* net, volume_t** input, double** likelihoods, int n)
+{
+  net_classify_fn(net, copy_input, input, likelihoods, n);
 }
@@ -7,6 +7,9 @@
 #define NUM_LAYERS 11
 #define NUM_CLASSES 10
 
+// Default for network_t.batch_size.
+#define NET_DEFAULT_BATCH 8
+
 // Defines the specific network architecture that we use for this project. Layer
 // elements in the struct are in the same order as they are in the network
 // itself.
@@ -23,6 +26,26 @@ typedef struct network {
   pool_layer_t* l8;
   fc_layer_t* l9;
   softmax_layer_t* l10;
+
+  // Whether net_forward runs each conv -> relu -> pool block as one fused
+  // operator. The fused blocks never write their conv and relu volumes
+  // (batch layers 1, 2, 4, 5, 7 and 8).
+  int fused;
+
+  // Images net_classify runs through net_forward at once on each thread. 1
+  // gives the lowest latency per image; larger batches let batch-aware
+  // kernels reuse the weights across images. Taken from the NET_BATCH
+  // environment variable if it is set.
+  int batch_size;
+
+  // Read-only mapping of the binary snapshot the weights point into (see
+  // snapshot.h), or NULL if they were loaded from the text files.
+  void* snapshot;
+  size_t snapshot_size;
+
+  // Per-stage counters net_forward adds to (see profile.h), NULL to run
+  // without timing. Owned by the caller.
+  struct net_profile* profile;
 } network_t;
 
 // Creates a new instance of our network
@@ -40,10 +63,23 @@ void free_network(network_t* net);
 // forward functions of the different layers.
 typedef volume_t** batch_t;
 
-// Allocates a new batch for the network old_net with size images
+// Allocates a new batch for the network old_net with size images. All of its
+// volumes are carved out of one zeroed, 64 byte aligned block, and the
+// weights pointer of every volume is 64 byte aligned. The volumes must not be
+// freed on their own.
 batch_t* make_batch(network_t* net, int size);
 
-// Frees a previously allocated batch
+// Allocates a batch for inference only: layer i uses buffer i % 2, so later
+// layers overwrite earlier ones, the input (layer 0) included, and after
+// net_forward only the likelihoods (layer NUM_LAYERS) of each image are
+// meaningful. Decode the input again before another net_forward. The
+// buffers are sized for net->fused at the time of the call, and the volumes
+// of layers the fused path never writes have no weights. Use make_batch to
+// keep every layer.
+batch_t* make_inference_batch(network_t* net, int size);
+
+// Frees a batch made by make_batch or make_inference_batch, volumes included,
+// in one release
 void free_batch(batch_t* v, int size);
 
 // Apply our network to a specific batch of inputs. The batch has to be given
@@ -52,9 +88,19 @@ void free_batch(batch_t* v, int size);
 void net_forward(network_t* net, batch_t* b, int start, int end);
 
 // Putting everything together: Take a set of n input images as 3-dimensional
-// Volumes and process them using the CNN in batches of 1. It saves the
-// likelihood of each label into the likelihoods array.
+// Volumes and process them using the CNN in batches of up to net->batch_size.
+// Each thread takes contiguous chunks of images. It saves the likelihood of
+// each label into the likelihoods array.
 void net_classify(network_t* net, volume_t** input, double** likelihoods, int n);
 
+// Writes input image i of a classification into the network's input volume v
+// (the interior of a volume shaped like net->layers[0]). arg is passed through
+// from net_classify_fn. Called concurrently from several threads.
+typedef void (*net_input_fn)(void* arg, int i, volume_t* v);
+
+// Same as net_classify, except that the n input images are produced on demand
+// by input, right before each is run, so they never all have to exist at once.
+void net_classify_fn(network_t* net, net_input_fn input, void* arg, double** likelihoods, int n);
+
 #endif
 
@@ -0,0 +1,340 @@
+// pthreads, sched_yield
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include OpenMP
+#include <omp.h>
+
+#include "network.h"
+#include "pipeline.h"
+#include "volume.h"
+
+// Keeps the hot counters of the queues and the pipeline on their own cache
+// lines.
+#define CACHE_LINE 64
+
+// Bounded multi-producer multi-consumer queue of ints (D. Vyukov's array
+// queue). Cell i is free for the push at position pos when its sequence number
+// equals pos, and holds the value for the pop at position pos when it equals
+// pos + 1.
+typedef struct queue_cell {
+  size_t seq;
+  int value;
+} queue_cell_t;
+
+typedef struct queue {
+  queue_cell_t* cells;
+  size_t mask;
+  char pad0[CACHE_LINE];
+  size_t head;  // Next push position
+  char pad1[CACHE_LINE];
+  size_t tail;  // Next pop position
+  char pad2[CACHE_LINE];
+} queue_t;
+
+static void queue_init(queue_t* q, int capacity)
+{
+  size_t size = 1;
+  while (size < (size_t)capacity)
+  {
+    size *= 2;
+  }
+
+  q->cells = (queue_cell_t*)malloc(sizeof(queue_cell_t) * size);
+  for (size_t i = 0; i < size; i++)
+  {
+    q->cells[i].seq = i;
+  }
+  q->mask = size - 1;
+  q->head = 0;
+  q->tail = 0;
+}
+
+// Returns 0 if the queue is full.
+static int queue_push(queue_t* q, int value)
+{
+  size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    queue_cell_t* cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos)
+    {
+      if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        cell->value = value;
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if (seq < pos)
+    {
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Returns 0 if the queue is empty.
+static int queue_pop(queue_t* q, int* value)
+{
+  size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+  for (;;)
+  {
+    queue_cell_t* cell = &q->cells[pos & q->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq == pos + 1)
+    {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      {
+        *value = cell->value;
+        __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    }
+    else if (seq < pos + 1)
+    {
+      return 0;
+    }
+    else
+    {
+      pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+typedef struct pipeline {
+  network_t* net;
+  net_input_fn input;
+  void* input_arg;
+  int n;
+
+  // Most images a worker runs through net_forward at once.
+  int batch_size;
+
+  // Input volumes shaped like net->layers[0], and the image each one holds.
+  int depth;
+  volume_t** slots;
+  int* slot_image;
+  queue_t free;   // Slots the decoders may fill
+  queue_t ready;  // Decoded slots for the workers
+
+  // Reorder ring: image i is written to results[i % window] and flagged in
+  // done[i % window]. Decoders only start image i once i < collected + window,
+  // so a ring entry is always free by the time its image is finished.
+  int window;
+  double* results;
+  int* done;
+
+  char pad0[CACHE_LINE];
+  int next;       // Next image to decode
+  char pad1[CACHE_LINE];
+  int taken;      // Images taken by the workers
+  char pad2[CACHE_LINE];
+  int collected;  // Images handed to the output callback
+  char pad3[CACHE_LINE];
+} pipeline_t;
+
+// Backs off while waiting for another stage.
+static inline void pipeline_wait()
+{
+  sched_yield();
+}
+
+static void* pipeline_decoder(void* arg)
+{
+  pipeline_t* p = (pipeline_t*)arg;
+
+  for (;;)
+  {
+    int i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+    if (i >= p->n)
+    {
+      break;
+    }
+    while (i >= __atomic_load_n(&p->collected, __ATOMIC_ACQUIRE) + p->window)
+    {
+      pipeline_wait();
+    }
+
+    int slot;
+    while (!queue_pop(&p->free, &slot))
+    {
+      pipeline_wait();
+    }
+    p->slot_image[slot] = i;
+    p->input(p->input_arg, i, p->slots[slot]);
+    while (!queue_push(&p->ready, slot))
+    {
+      pipeline_wait();
+    }
+  }
+
+  return NULL;
+}
+
+// Takes whatever decoded slots are ready, up to a batch, and runs them
+// through net_forward at once, so the layers reuse their weights across the
+// images of the batch as in net_classify.
+static void* pipeline_worker(void* arg)
+{
+  pipeline_t* p = (pipeline_t*)arg;
+
+  // The worker's own input volumes are swapped for the decoded slots, which
+  // have the same shape and halo, so nothing is copied.
+  int size = p->batch_size;
+  batch_t* b = make_inference_batch(p->net, size);
+  volume_t* own[size];
+  int slots[size];
+  for (int k = 0; k < size; k++)
+  {
+    own[k] = b[0][k];
+  }
+
+  for (;;)
+  {
+    int count = 0;
+    while (count < size && queue_pop(&p->ready, &slots[count]))
+    {
+      count++;
+    }
+    if (count == 0)
+    {
+      if (__atomic_load_n(&p->taken, __ATOMIC_ACQUIRE) >= p->n)
+      {
+        break;
+      }
+      pipeline_wait();
+      continue;
+    }
+    __atomic_fetch_add(&p->taken, count, __ATOMIC_RELEASE);
+
+    for (int k = 0; k < count; k++)
+    {
+      b[0][k] = p->slots[slots[k]];
+    }
+    net_forward(p->net, b, 0, count - 1);
+
+    for (int k = 0; k < count; k++)
+    {
+      b[0][k] = own[k];
+
+      int r = p->slot_image[slots[k]] % p->window;
+      for (int j = 0; j < NUM_CLASSES; j++)
+      {
+        p->results[r * NUM_CLASSES + j] = b[11][k]->weights[j];
+      }
+      __atomic_store_n(&p->done[r], 1, __ATOMIC_RELEASE);
+
+      while (!queue_push(&p->free, slots[k]))
+      {
+        pipeline_wait();
+      }
+    }
+  }
+
+  free_batch(b, size);
+  return NULL;
+}
+
+pipeline_config_t pipeline_default_config(network_t* net)
+{
+  pipeline_config_t config;
+  config.decoders = 1;
+  config.workers  = omp_get_max_threads();
+  config.depth    = 2 * config.workers * net->batch_size;
+  return config;
+}
+
+void net_classify_stream(network_t* net, net_input_fn input, void* input_arg, net_output_fn output, void* output_arg,
+                         int n, const pipeline_config_t* config)
+{
+  pipeline_config_t defaults = pipeline_default_config(net);
+  if (config == NULL)
+  {
+    config = &defaults;
+  }
+  assert(config->decoders > 0 && config->workers > 0 && config->depth > 0);
+
+  pipeline_t* p = (pipeline_t*)malloc(sizeof(pipeline_t));
+  p->net       = net;
+  p->input     = input;
+  p->input_arg = input_arg;
+  p->n         = n;
+
+  // A worker cannot fill a batch beyond its share of the slots.
+  p->batch_size = net->batch_size;
+  if (p->batch_size * config->workers > config->depth)
+  {
+    p->batch_size = config->depth / config->workers;
+  }
+  if (p->batch_size < 1)
+  {
+    p->batch_size = 1;
+  }
+
+  volume_t* shape = net->layers[0];
+  p->depth      = config->depth;
+  p->slots      = (volume_t**)malloc(sizeof(volume_t*) * p->depth);
+  p->slot_image = (int*)malloc(sizeof(int) * p->depth);
+  queue_init(&p->free, p->depth);
+  queue_init(&p->ready, p->depth);
+  for (int s = 0; s < p->depth; s++)
+  {
+    p->slots[s] = make_padded_volume(shape->width, shape->height, shape->depth, shape->pad);
+    queue_push(&p->free, s);
+  }
+
+  p->window  = 2 * p->depth;
+  p->results = (double*)malloc(sizeof(double) * p->window * NUM_CLASSES);
+  p->done    = (int*)calloc(p->window, sizeof(int));
+
+  p->next      = 0;
+  p->taken     = 0;
+  p->collected = 0;
+
+  int num_threads = config->decoders + config->workers;
+  pthread_t threads[num_threads];
+  for (int t = 0; t < num_threads; t++)
+  {
+    pthread_create(&threads[t], NULL, (t < config->decoders) ? pipeline_decoder : pipeline_worker, p);
+  }
+
+  // Collector
+  for (int i = 0; i < n; i++)
+  {
+    int r = i % p->window;
+    while (!__atomic_load_n(&p->done[r], __ATOMIC_ACQUIRE))
+    {
+      pipeline_wait();
+    }
+    output(output_arg, i, &p->results[r * NUM_CLASSES]);
+    p->done[r] = 0;
+    __atomic_store_n(&p->collected, i + 1, __ATOMIC_RELEASE);
+  }
+
+  for (int t = 0; t < num_threads; t++)
+  {
+    pthread_join(threads[t], NULL);
+  }
+
+  for (int s = 0; s < p->depth; s++)
+  {
+    free_volume(p->slots[s]);
+  }
+  free(p->slots);
+  free(p->slot_image);
+  free(p->free.cells);
+  free(p->ready.cells);
+  free(p->results);
+  free(p->done);
+  free(p);
+}
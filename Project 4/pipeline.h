@@ -0,0 +1,35 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "network.h"
+
+// Streaming classification. Decoder threads produce input images with the
+// input callback of net_classify_fn into a fixed pool of input volumes,
+// worker threads run the network on them as soon as they are ready, in
+// batches of up to net->batch_size images like net_classify, and the calling
+// thread collects the likelihoods and hands them out in image order. The
+// stages are connected by bounded lock-free queues, so at most a few batches
+// per thread are in flight however many are classified, and decoding
+// overlaps with compute.
+
+// Receives the likelihoods of image i. Called from the thread that started
+// the classification, for i = 0, 1, ..., n - 1 in order.
+typedef void (*net_output_fn)(void* arg, int i, const double* likelihoods);
+
+typedef struct pipeline_config {
+  int decoders;  // Threads running the input callback
+  int workers;   // Threads running net_forward
+  int depth;     // Input volumes shared by the decoders and the workers
+} pipeline_config_t;
+
+// One decoder, one worker per OpenMP thread and input volumes for two
+// batches of net->batch_size images per worker.
+pipeline_config_t pipeline_default_config(network_t* net);
+
+// Classifies n images produced by input and passes their likelihoods to
+// output. config may be NULL for pipeline_default_config(net). Workers run
+// batches of at most depth / workers images.
+void net_classify_stream(network_t* net, net_input_fn input, void* input_arg, net_output_fn output, void* output_arg,
+                         int n, const pipeline_config_t* config);
+
+#endif
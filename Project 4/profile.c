@@ -0,0 +1,509 @@
+// clock_gettime, syscall
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "layers.h"
+#include "network.h"
+#include "profile.h"
+#include "volume.h"
+
+// Size of a row of counters, rounded up to whole cache lines.
+#define PROFILE_ROW ((sizeof(profile_counters_t) + 63) / 64 * 64)
+
+// Row of the calling thread, handed out on its first lap.
+static __thread int profile_slot = -1;
+static int profile_next_slot = 0;
+
+// Hardware events of the calling thread: one perf_event group, read with a
+// single system call. member[i] is the event of the group's i-th value.
+typedef struct profile_hw {
+  int state;  // 0 not opened yet, 1 open, -1 unavailable
+  int fd;     // group leader
+  int n;
+  int member[PROFILE_NUM_EVENTS];
+  int fds[PROFILE_NUM_EVENTS];  // Of the members, the leader first
+  unsigned mask;
+  uint64_t last[PROFILE_NUM_EVENTS];
+} profile_hw_t;
+
+static __thread profile_hw_t profile_hw;
+
+static const char* const event_names[PROFILE_NUM_EVENTS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+#if defined(__linux__)
+static void hw_attr(struct perf_event_attr* attr, int event)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->size           = sizeof(*attr);
+  attr->read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  // User space only, which perf_event_paranoid 2 still allows.
+  attr->exclude_kernel = 1;
+  attr->exclude_hv     = 1;
+
+  uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  switch (event)
+  {
+    case PROFILE_CYCLES:
+      attr->type   = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case PROFILE_INSTRUCTIONS:
+      attr->type   = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case PROFILE_L1D_MISSES:
+      attr->type   = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D | read_miss;
+      break;
+    case PROFILE_LLC_MISSES:
+      attr->type   = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_LL | read_miss;
+      break;
+    case PROFILE_BRANCH_MISSES:
+      attr->type   = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+  }
+}
+#endif
+
+// Reads the events of the group into values, indexed by event. If the kernel
+// had to multiplex the PMU, scales them up to the time the group was enabled.
+static int hw_read(profile_hw_t* hw, uint64_t* values)
+{
+#if defined(__linux__)
+  uint64_t buf[3 + PROFILE_NUM_EVENTS];
+  if (read(hw->fd, buf, sizeof(buf)) < (ssize_t)((3 + hw->n) * sizeof(uint64_t)))
+  {
+    return 0;
+  }
+  double scale = (buf[2] > 0 && buf[2] < buf[1]) ? (double)buf[1] / buf[2] : 1.0;
+  for (int i = 0; i < hw->n; i++)
+  {
+    values[hw->member[i]] = (scale == 1.0) ? buf[3 + i] : (uint64_t)(buf[3 + i] * scale);
+  }
+  return 1;
+#else
+  (void)hw;
+  (void)values;
+  return 0;
+#endif
+}
+
+// Opens the events of the calling thread on its first call. Events that do
+// not open are left out of the group; if none does, errno is that of the
+// first failure.
+static profile_hw_t* hw_open()
+{
+  profile_hw_t* hw = &profile_hw;
+  if (hw->state != 0)
+  {
+    return (hw->state > 0) ? hw : NULL;
+  }
+  hw->state = -1;
+  hw->fd    = -1;
+
+#if defined(__linux__)
+  int error = 0;
+  for (int e = 0; e < PROFILE_NUM_EVENTS; e++)
+  {
+    struct perf_event_attr attr;
+    hw_attr(&attr, e);
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, hw->fd, 0);
+    if (fd < 0)
+    {
+      error = (error == 0) ? errno : error;
+      continue;
+    }
+    hw->fd = (hw->fd < 0) ? fd : hw->fd;
+    hw->fds[hw->n]      = fd;
+    hw->member[hw->n++] = e;
+    hw->mask |= 1u << e;
+  }
+  if (hw->fd >= 0 && !hw_read(hw, hw->last))
+  {
+    error = errno;
+    for (int i = 0; i < hw->n; i++)
+    {
+      close(hw->fds[i]);
+    }
+    hw->fd   = -1;
+    hw->n    = 0;
+    hw->mask = 0;
+  }
+  if (hw->fd < 0)
+  {
+    errno = (error != 0) ? error : errno;
+    return NULL;
+  }
+  hw->state = 1;
+  return hw;
+#else
+  errno = ENOSYS;
+  return NULL;
+#endif
+}
+
+static double volume_bytes(int width, int height, int depth)
+{
+  return (double)width * height * depth * sizeof(real_t);
+}
+
+static void stage_conv(profile_stage_t* s, conv_layer_t* l)
+{
+  s->name         = "conv";
+  s->flops        = 2.0 * l->output_width * l->output_height * l->output_depth * l->num_weights;
+  s->bytes        = volume_bytes(l->input_width, l->input_height, l->input_depth) +
+                    volume_bytes(l->output_width, l->output_height, l->output_depth);
+  s->weight_bytes = (double)(l->num_weights + 1) * l->output_depth * sizeof(real_t);
+}
+
+static void stage_relu(profile_stage_t* s, relu_layer_t* l)
+{
+  s->name         = "relu";
+  s->flops        = (double)l->output_width * l->output_height * l->output_depth;
+  s->bytes        = 2 * volume_bytes(l->output_width, l->output_height, l->output_depth);
+  s->weight_bytes = 0;
+}
+
+// A comparison per pool window element.
+static void stage_pool(profile_stage_t* s, pool_layer_t* l)
+{
+  s->name         = "pool";
+  s->flops        = (double)l->output_width * l->output_height * l->output_depth * l->pool_width * l->pool_height;
+  s->bytes        = volume_bytes(l->input_width, l->input_height, l->input_depth) +
+                    volume_bytes(l->output_width, l->output_height, l->output_depth);
+  s->weight_bytes = 0;
+}
+
+// The fused block never writes the conv and relu volumes.
+static void stage_fused(profile_stage_t* s, conv_layer_t* c, relu_layer_t* r, pool_layer_t* p)
+{
+  profile_stage_t relu;
+  profile_stage_t pool;
+  stage_conv(s, c);
+  stage_relu(&relu, r);
+  stage_pool(&pool, p);
+
+  s->name   = "conv+relu+pool";
+  s->flops += relu.flops + pool.flops;
+  s->bytes  = volume_bytes(c->input_width, c->input_height, c->input_depth) +
+              volume_bytes(p->output_width, p->output_height, p->output_depth);
+}
+
+net_profile_t* make_net_profile(network_t* net)
+{
+  net_profile_t* p = (net_profile_t*)malloc(sizeof(net_profile_t));
+  memset(p->stages, 0, sizeof(p->stages));
+
+  conv_layer_t* convs[3] = {net->l0, net->l3, net->l6};
+  relu_layer_t* relus[3] = {net->l1, net->l4, net->l7};
+  pool_layer_t* pools[3] = {net->l2, net->l5, net->l8};
+  for (int i = 0; i < 3; i++)
+  {
+    if (net->fused)
+    {
+      stage_fused(&p->stages[3 * i], convs[i], relus[i], pools[i]);
+    }
+    else
+    {
+      stage_conv(&p->stages[3 * i], convs[i]);
+      stage_relu(&p->stages[3 * i + 1], relus[i]);
+      stage_pool(&p->stages[3 * i + 2], pools[i]);
+    }
+  }
+
+  fc_layer_t* fc = net->l9;
+  p->stages[9].name         = "fc";
+  p->stages[9].flops        = 2.0 * fc->num_inputs * fc->output_depth;
+  p->stages[9].bytes        = volume_bytes(fc->input_width, fc->input_height, fc->input_depth) +
+                              volume_bytes(1, 1, fc->output_depth);
+  p->stages[9].weight_bytes = (double)(fc->num_inputs + 1) * fc->output_depth * sizeof(real_t);
+
+  // Max, subtraction, exp, sum and division per class, exp counted as one.
+  softmax_layer_t* sm = net->l10;
+  p->stages[10].name         = "softmax";
+  p->stages[10].flops        = 5.0 * sm->output_depth;
+  p->stages[10].bytes        = 2 * volume_bytes(1, 1, sm->output_depth);
+  p->stages[10].weight_bytes = 0;
+
+  p->threads  = _mm_malloc(PROFILE_MAX_THREADS * PROFILE_ROW, 64);
+  p->counters = 0;
+  p->events   = 0;
+  profile_reset(p);
+
+  return p;
+}
+
+unsigned profile_enable_counters(net_profile_t* p)
+{
+  profile_hw_t* hw = hw_open();
+  if (hw == NULL)
+  {
+    return 0;
+  }
+  p->counters = 1;
+  __atomic_fetch_or(&p->events, hw->mask, __ATOMIC_RELAXED);
+  return hw->mask;
+}
+
+void free_net_profile(net_profile_t* p)
+{
+  _mm_free(p->threads);
+  free(p);
+}
+
+void profile_reset(net_profile_t* p)
+{
+  memset(p->threads, 0, PROFILE_MAX_THREADS * PROFILE_ROW);
+}
+
+void profile_totals(net_profile_t* p, profile_counters_t* total)
+{
+  memset(total, 0, sizeof(profile_counters_t));
+  for (int t = 0; t < PROFILE_MAX_THREADS; t++)
+  {
+    profile_counters_t* c = (profile_counters_t*)(p->threads + t * PROFILE_ROW);
+    for (int s = 0; s < NUM_LAYERS; s++)
+    {
+      total->ns[s]     += __atomic_load_n(&c->ns[s], __ATOMIC_RELAXED);
+      total->images[s] += __atomic_load_n(&c->images[s], __ATOMIC_RELAXED);
+      total->calls[s]  += __atomic_load_n(&c->calls[s], __ATOMIC_RELAXED);
+      for (int e = 0; e < PROFILE_NUM_EVENTS; e++)
+      {
+        total->events[s][e] += __atomic_load_n(&c->events[s][e], __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+static uint64_t profile_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t profile_start(net_profile_t* p)
+{
+  if (p == NULL)
+  {
+    return 0;
+  }
+  uint64_t now = profile_now();
+
+  profile_hw_t* hw;
+  if (p->counters && (hw = hw_open()) != NULL)
+  {
+    if ((__atomic_load_n(&p->events, __ATOMIC_RELAXED) & hw->mask) != hw->mask)
+    {
+      __atomic_fetch_or(&p->events, hw->mask, __ATOMIC_RELAXED);
+    }
+    hw_read(hw, hw->last);
+  }
+  return now;
+}
+
+// The adds are atomic only because threads past PROFILE_MAX_THREADS share
+// rows; the row of a thread of its own stays in that thread's cache.
+uint64_t profile_lap(net_profile_t* p, int stage, int images, uint64_t t0)
+{
+  if (p == NULL)
+  {
+    return 0;
+  }
+  uint64_t now = profile_now();
+
+  if (profile_slot < 0)
+  {
+    profile_slot = __atomic_fetch_add(&profile_next_slot, 1, __ATOMIC_RELAXED) % PROFILE_MAX_THREADS;
+  }
+  profile_counters_t* c = (profile_counters_t*)(p->threads + profile_slot * PROFILE_ROW);
+  __atomic_fetch_add(&c->ns[stage], now - t0, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->images[stage], images, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->calls[stage], 1, __ATOMIC_RELAXED);
+
+  profile_hw_t* hw;
+  uint64_t values[PROFILE_NUM_EVENTS];
+  if (p->counters && (hw = hw_open()) != NULL && hw_read(hw, values))
+  {
+    for (int i = 0; i < hw->n; i++)
+    {
+      // Scaled counts can step back when the multiplexing ratio changes.
+      int e = hw->member[i];
+      if (values[e] > hw->last[e])
+      {
+        __atomic_fetch_add(&c->events[stage][e], values[e] - hw->last[e], __ATOMIC_RELAXED);
+      }
+      hw->last[e] = values[e];
+    }
+  }
+
+  return now;
+}
+
+void profile_work(net_profile_t* p, const profile_counters_t* total, int stage, double* flops, double* bytes)
+{
+  profile_stage_t* st = &p->stages[stage];
+  *flops = st->flops * total->images[stage];
+  *bytes = st->bytes * total->images[stage] + st->weight_bytes * total->calls[stage];
+}
+
+// Writes the events of mask and the instructions per cycle, as the columns
+// or members that follow those of profile_write_row.
+static void profile_write_events(FILE* out, int json, unsigned mask, const uint64_t* events)
+{
+  for (int e = 0; e < PROFILE_NUM_EVENTS; e++)
+  {
+    if (json)
+    {
+      fprintf(out, ", \"%s\": ", event_names[e]);
+    }
+    else
+    {
+      fprintf(out, ",");
+    }
+    if (mask & (1u << e))
+    {
+      fprintf(out, "%lu", (unsigned long)events[e]);
+    }
+    else if (json)
+    {
+      fprintf(out, "null");
+    }
+  }
+
+  unsigned ipc = (1u << PROFILE_CYCLES) | (1u << PROFILE_INSTRUCTIONS);
+  fprintf(out, json ? ", \"ipc\": " : ",");
+  if ((mask & ipc) == ipc && events[PROFILE_CYCLES] > 0)
+  {
+    fprintf(out, "%.3f", (double)events[PROFILE_INSTRUCTIONS] / events[PROFILE_CYCLES]);
+  }
+  else if (json)
+  {
+    fprintf(out, "null");
+  }
+}
+
+// Writes one row of the table: work is flops and bytes in total, events
+// NULL without counters.
+static void profile_write_row(FILE* out, int json, const char* layer, const char* name, uint64_t calls,
+                              uint64_t images, uint64_t ns, double flops, double bytes, unsigned mask,
+                              const uint64_t* events)
+{
+  double ms        = ns / 1e6;
+  double us_image  = (images > 0) ? ns / 1e3 / images : 0.0;
+  double mflop     = (images > 0) ? flops / 1e6 / images : 0.0;
+  double gflops    = (ns > 0) ? flops / ns : 0.0;
+  double gbs       = (ns > 0) ? bytes / ns : 0.0;
+
+  if (json)
+  {
+    fprintf(out,
+            "{\"layer\": %s, \"name\": \"%s\", \"calls\": %lu, \"images\": %lu, \"time_ms\": %.3f, "
+            "\"us_per_image\": %.3f, \"mflop_per_image\": %.6f, \"gflops\": %.3f, \"gbs\": %.3f",
+            layer, name, (unsigned long)calls, (unsigned long)images, ms, us_image, mflop, gflops, gbs);
+  }
+  else
+  {
+    fprintf(out, "%s,%s,%lu,%lu,%.3f,%.3f,%.6f,%.3f,%.3f", layer, name, (unsigned long)calls,
+            (unsigned long)images, ms, us_image, mflop, gflops, gbs);
+  }
+  if (events != NULL)
+  {
+    profile_write_events(out, json, mask, events);
+  }
+  fprintf(out, json ? "}" : "\n");
+}
+
+void profile_write(net_profile_t* p, FILE* out, int json, uint64_t wall_ns)
+{
+  profile_counters_t total;
+  profile_totals(p, &total);
+  unsigned mask = __atomic_load_n(&p->events, __ATOMIC_RELAXED);
+
+  if (json)
+  {
+    fprintf(out, "{\n  \"wall_ms\": %.3f,\n  \"stages\": [", wall_ns / 1e6);
+  }
+  else
+  {
+    fprintf(out, "layer,name,calls,images,time_ms,us_per_image,mflop_per_image,gflops,gbs");
+    for (int e = 0; mask != 0 && e < PROFILE_NUM_EVENTS; e++)
+    {
+      fprintf(out, ",%s", event_names[e]);
+    }
+    fprintf(out, (mask != 0) ? ",ipc\n" : "\n");
+  }
+
+  uint64_t calls  = 0;
+  uint64_t images = 0;
+  uint64_t ns     = 0;
+  double flops    = 0.0;
+  double bytes    = 0.0;
+  int rows        = 0;
+  uint64_t events[PROFILE_NUM_EVENTS] = {0};
+  for (int s = 0; s < NUM_LAYERS; s++)
+  {
+    profile_stage_t* st = &p->stages[s];
+    if (st->name == NULL || total.calls[s] == 0)
+    {
+      continue;
+    }
+    double stage_flops, stage_bytes;
+    profile_work(p, &total, s, &stage_flops, &stage_bytes);
+
+    char layer[16];
+    snprintf(layer, sizeof(layer), "%d", s);
+    if (json)
+    {
+      fprintf(out, "%s\n    ", (rows > 0) ? "," : "");
+    }
+    profile_write_row(out, json, layer, st->name, total.calls[s], total.images[s], total.ns[s], stage_flops,
+                      stage_bytes, mask, (mask != 0) ? total.events[s] : NULL);
+
+    calls += total.calls[s];
+    images = (total.images[s] > images) ? total.images[s] : images;
+    ns    += total.ns[s];
+    flops += stage_flops;
+    bytes += stage_bytes;
+    for (int e = 0; e < PROFILE_NUM_EVENTS; e++)
+    {
+      events[e] += total.events[s][e];
+    }
+    rows++;
+  }
+
+  if (json)
+  {
+    fprintf(out, "\n  ],\n  \"total\": ");
+    profile_write_row(out, json, "null", "total", calls, images, ns, flops, bytes, mask,
+                      (mask != 0) ? events : NULL);
+    fprintf(out, "\n}\n");
+  }
+  else
+  {
+    profile_write_row(out, json, "", "total", calls, images, ns, flops, bytes, mask, (mask != 0) ? events : NULL);
+  }
+}
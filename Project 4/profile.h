@@ -0,0 +1,112 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "network.h"
+
+// Per-stage instrumentation of net_forward. When network_t.profile is set,
+// net_forward reads the monotonic clock between its stages and adds the time
+// to the calling thread's own counters, so the threads of net_classify (or of
+// a net_context) never write to a shared cache line. A stage is one layer, or
+// with net->fused one conv -> relu -> pool block, which is recorded under the
+// index of its conv layer.
+//
+// With profile_enable_counters, each thread also counts hardware events with
+// perf_event_open (Linux only) and adds what they advanced between two laps
+// to the same stage, so a stage's cycles, cache misses and branch misses are
+// those of its *_forward calls on every thread. Events the CPU or the kernel
+// does not provide (no PMU in most VMs and containers, perf_event_paranoid,
+// seccomp) are left out, and the profile times stages as before.
+
+// Threads with counters of their own; further threads share theirs.
+#define PROFILE_MAX_THREADS 256
+
+// Hardware events counted per stage with counters enabled.
+typedef enum profile_event {
+  PROFILE_CYCLES,
+  PROFILE_INSTRUCTIONS,
+  PROFILE_L1D_MISSES,     // L1 data cache read misses
+  PROFILE_LLC_MISSES,     // Last level cache read misses
+  PROFILE_BRANCH_MISSES,  // Mispredicted branches
+  PROFILE_NUM_EVENTS
+} profile_event_t;
+
+// Work done by a stage, computed from the layer shapes. Multiply-adds count
+// as 2 flops, and the flops of a conv layer are those of a direct convolution
+// whichever algorithm runs it. bytes is the size of the stage's input and
+// output volumes, weight_bytes that of the weights, which are read once per
+// call whatever the number of images.
+typedef struct profile_stage {
+  const char* name;
+  double flops;          // per image
+  double bytes;          // per image
+  double weight_bytes;   // per call
+} profile_stage_t;
+
+typedef struct profile_counters {
+  uint64_t ns[NUM_LAYERS];
+  uint64_t images[NUM_LAYERS];
+  uint64_t calls[NUM_LAYERS];
+  uint64_t events[NUM_LAYERS][PROFILE_NUM_EVENTS];
+} profile_counters_t;
+
+typedef struct net_profile {
+  // Stages net_forward runs, name NULL for the layers it skips.
+  profile_stage_t stages[NUM_LAYERS];
+
+  // PROFILE_MAX_THREADS rows of profile_counters_t, each starting on its own
+  // cache line.
+  char* threads;
+
+  // Whether threads count hardware events, and the mask (bit e for event e)
+  // of those some thread has counted.
+  int counters;
+  unsigned events;
+} net_profile_t;
+
+// Creates a profile of the stages of net, fused or not as net->fused is at
+// the time of the call, with all counters zero. Profiling starts once
+// net->profile points to it; the caller frees it after resetting that.
+net_profile_t* make_net_profile(network_t* net);
+
+void free_net_profile(net_profile_t* p);
+
+// Enables hardware event counting, opening the events on the calling thread
+// and on every other thread at its first profile_start. Returns the mask of
+// events the calling thread counts; if that is 0 (errno tells why), leaves
+// counting disabled. Events stay open until their thread exits, so a thread
+// opens them once whatever the number of profiles.
+unsigned profile_enable_counters(net_profile_t* p);
+
+// Zeros the counters of every thread.
+void profile_reset(net_profile_t* p);
+
+// Sums the counters of every thread into total.
+void profile_totals(net_profile_t* p, profile_counters_t* total);
+
+// Computes the flops and bytes of stage over the calls and images of total.
+void profile_work(net_profile_t* p, const profile_counters_t* total, int stage, double* flops, double* bytes);
+
+// Returns the time of the monotonic clock in nanoseconds, or 0 if p is NULL.
+// With counters enabled, also reads the calling thread's events.
+uint64_t profile_start(net_profile_t* p);
+
+// Adds the time since t0 (from profile_start or the previous lap) and a call
+// on images images to the calling thread's counters of stage, and returns the
+// current time. With counters enabled, also adds the events counted since the
+// thread's previous profile_start or lap; reading them takes a system call,
+// which falls into the next stage's time. Does nothing and returns 0 if p is
+// NULL.
+uint64_t profile_lap(net_profile_t* p, int stage, int images, uint64_t t0);
+
+// Writes a table of the stages that ran: calls, images, time (summed over
+// the threads), time per image, GFLOP/s and GB/s (per thread, i.e. work over
+// thread time), and a total row. If events were counted, each row also holds
+// their totals and the instructions per cycle, empty (null in JSON) for the
+// events no thread counted. With json, writes a JSON object instead of CSV,
+// which also holds wall_ns, the wall time of the profiled run.
+void profile_write(net_profile_t* p, FILE* out, int json, uint64_t wall_ns);
+
+#endif
@@ -0,0 +1,268 @@
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "kernels.h"
+#include "layers.h"
+#include "quant.h"
+#include "volume.h"
+
+// Largest quantized activation / weight magnitude (see quant.h).
+#define QUANT_MAX 127
+
+static quant_t* quant_build(volume_t** filters, int num_filters, real_t in_scale, int in_zero, const real_t* weight_scales)
+{
+  quant_t* q = (quant_t*)malloc(sizeof(quant_t));
+
+  q->num_inputs     = filters[0]->width * filters[0]->height * filters[0]->depth;
+  q->padded_inputs  = (q->num_inputs + 3) / 4 * 4;
+  q->num_outputs    = num_filters;
+  q->packed_outputs = (num_filters + QUANT_NR - 1) / QUANT_NR * QUANT_NR;
+
+  q->in_scale = in_scale;
+  q->in_zero  = in_zero;
+
+  q->weight_scales = (real_t*)malloc(sizeof(real_t) * num_filters);
+  q->out_scales    = (real_t*)malloc(sizeof(real_t) * num_filters);
+  q->corrections   = (int32_t*)malloc(sizeof(int32_t) * num_filters);
+
+  int ldb = q->packed_outputs * 4;
+  q->packed = _mm_malloc(q->padded_inputs / 4 * ldb, 64);
+  memset(q->packed, 0, q->padded_inputs / 4 * ldb);
+
+  for (int f = 0; f < num_filters; f++)
+  {
+    real_t scale = weight_scales[f];
+    int32_t sum = 0;
+    for (int k = 0; k < q->num_inputs; k++)
+    {
+      long v = (scale > 0.0) ? lrint(filters[f]->weights[k] / scale) : 0;
+      v = (v > QUANT_MAX) ? QUANT_MAX : ((v < -QUANT_MAX) ? -QUANT_MAX : v);
+      q->packed[(k / 4) * ldb + f * 4 + k % 4] = (int8_t)v;
+      sum += v;
+    }
+    q->weight_scales[f] = scale;
+    q->out_scales[f]    = in_scale * scale;
+    q->corrections[f]   = in_zero * sum;
+  }
+
+  return q;
+}
+
+quant_t* make_quant(volume_t** filters, int num_filters, real_t in_min, real_t in_max)
+{
+  // The range has to contain zero, so that the zero padding of a convolution
+  // is exactly representable.
+  in_min = (in_min > 0.0) ? 0.0 : in_min;
+  in_max = (in_max < 0.0) ? 0.0 : in_max;
+
+  real_t in_scale = (in_max > in_min) ? (in_max - in_min) / QUANT_MAX : 1.0;
+  int in_zero = (int)lrint(-in_min / in_scale);
+
+  int k_len = filters[0]->width * filters[0]->height * filters[0]->depth;
+  real_t weight_scales[num_filters];
+  for (int f = 0; f < num_filters; f++)
+  {
+    real_t amax = 0.0;
+    for (int k = 0; k < k_len; k++)
+    {
+      real_t w = fabs(filters[f]->weights[k]);
+      amax = (w > amax) ? w : amax;
+    }
+    weight_scales[f] = amax / QUANT_MAX;
+  }
+
+  return quant_build(filters, num_filters, in_scale, in_zero, weight_scales);
+}
+
+void free_quant(quant_t* q)
+{
+  if (q == NULL)
+  {
+    return;
+  }
+  free(q->weight_scales);
+  free(q->out_scales);
+  free(q->corrections);
+  _mm_free(q->packed);
+  free(q);
+}
+
+void quant_save(quant_t* q, const char* file_name)
+{
+  FILE* fout = fopen(file_name, "w");
+  assert(fout != NULL);
+
+  fprintf(fout, "%d %d\n", q->num_inputs, q->num_outputs);
+  fprintf(fout, "%.17g %d\n", (double)q->in_scale, q->in_zero);
+  for (int f = 0; f < q->num_outputs; f++)
+  {
+    fprintf(fout, "%.17g\n", (double)q->weight_scales[f]);
+  }
+
+  fclose(fout);
+}
+
+quant_t* quant_load(volume_t** filters, int num_filters, const char* file_name)
+{
+  FILE* fin = fopen(file_name, "r");
+  if (fin == NULL)
+  {
+    return NULL;
+  }
+
+  int num_inputs;
+  int num_outputs;
+  double in_scale;
+  int in_zero;
+  fscanf(fin, "%d %d", &num_inputs, &num_outputs);
+  assert(num_inputs == filters[0]->width * filters[0]->height * filters[0]->depth);
+  assert(num_outputs == num_filters);
+  fscanf(fin, "%lf %d", &in_scale, &in_zero);
+
+  real_t weight_scales[num_filters];
+  for (int f = 0; f < num_filters; f++)
+  {
+    double val;
+    fscanf(fin, "%lf", &val);
+    weight_scales[f] = val;
+  }
+
+  fclose(fin);
+
+  return quant_build(filters, num_filters, in_scale, in_zero, weight_scales);
+}
+
+static inline uint8_t quantize(real_t x, real_t inv_scale, int zero)
+{
+  int v = (int)(x * inv_scale + zero + 0.5);
+  return (v < 0) ? 0 : ((v > QUANT_MAX) ? QUANT_MAX : v);
+}
+
+// Quantizing counterpart of the im2col lowering in layers.c: taps in the
+// padding hold the zero point, the K..padded_inputs tail holds zeros. The
+// range of every layer contains zero, so a halo quantizes to the zero point
+// exactly and padded inputs are read without bounds checks.
+static void conv_im2col_q8(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, uint8_t* panel)
+{
+  quant_t* q = l->quant;
+  int pixels = l->output_width * l->output_height;
+  int depth = l->input_depth;
+  real_t inv_scale = 1.0 / q->in_scale;
+
+  for (int r = 0; r < rows; r++, row++)
+  {
+    volume_t* in = inputs[start + row / pixels];
+    int pixel = row % pixels;
+    int y = (pixel / l->output_width) * l->stride - l->pad;
+    int x = (pixel % l->output_width) * l->stride - l->pad;
+
+    uint8_t* dst = panel + r * q->padded_inputs;
+    if (in->pad >= l->pad)
+    {
+      for (int fy = 0; fy < l->filter_height; fy++, dst += l->filter_width * depth)
+      {
+        real_t* src = &in->weights[volume_offset(in, x, y + fy, 0)];
+        for (int k = 0; k < l->filter_width * depth; k++)
+        {
+          dst[k] = quantize(src[k], inv_scale, q->in_zero);
+        }
+      }
+      memset(dst, 0, q->padded_inputs - q->num_inputs);
+      continue;
+    }
+
+    for (int fy = 0; fy < l->filter_height; fy++)
+    {
+      int in_y = y + fy;
+      for (int fx = 0; fx < l->filter_width; fx++, dst += depth)
+      {
+        int in_x = x + fx;
+        if (in_y < 0 || in_y >= in->height || in_x < 0 || in_x >= in->width)
+        {
+          memset(dst, q->in_zero, depth);
+          continue;
+        }
+        real_t* src = &in->weights[volume_offset(in, in_x, in_y, 0)];
+        for (int d = 0; d < depth; d++)
+        {
+          dst[d] = quantize(src[d], inv_scale, q->in_zero);
+        }
+      }
+    }
+    memset(dst, 0, q->padded_inputs - q->num_inputs);
+  }
+}
+
+void conv_rows_q8(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, uint8_t* panel, real_t** dst)
+{
+  quant_t* q = l->quant;
+  int tiled = (rows + QUANT_MR - 1) / QUANT_MR * QUANT_MR;
+
+  conv_im2col_q8(l, inputs, start, row, rows, panel);
+  memset(panel + rows * q->padded_inputs, 0, (tiled - rows) * q->padded_inputs);
+  kernels()->quant_gemm(q, panel, rows, dst, l->biases->weights);
+}
+
+void conv_forward_q8(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  int pixels = l->output_width * l->output_height;
+  int total = pixels * (end - start + 1);
+
+  uint8_t* panel = _mm_malloc(QUANT_MC * l->quant->padded_inputs, 32);
+  real_t* dst[QUANT_MC];
+
+  for (int row = 0; row < total; row += QUANT_MC)
+  {
+    int rows = (total - row < QUANT_MC) ? total - row : QUANT_MC;
+    for (int i = 0; i < rows; i++)
+    {
+      volume_t* out = outputs[start + (row + i) / pixels];
+      int pixel = (row + i) % pixels;
+      dst[i] = &out->weights[volume_offset(out, pixel % l->output_width, pixel / l->output_width, 0)];
+    }
+    conv_rows_q8(l, inputs, start, row, rows, panel, dst);
+  }
+
+  _mm_free(panel);
+}
+
+void fc_forward_q8(fc_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  quant_t* q = l->quant;
+  real_t inv_scale = 1.0 / q->in_scale;
+
+  uint8_t* panel = _mm_malloc(QUANT_MC * q->padded_inputs, 32);
+  real_t* dst[QUANT_MC];
+
+  for (int j = start; j <= end; j += QUANT_MC)
+  {
+    int rows = (end + 1 - j < QUANT_MC) ? end + 1 - j : QUANT_MC;
+    int tiled = (rows + QUANT_MR - 1) / QUANT_MR * QUANT_MR;
+    memset(panel, 0, tiled * q->padded_inputs);
+
+    for (int i = 0; i < rows; i++)
+    {
+      real_t* src = inputs[j + i]->weights;
+      uint8_t* row = panel + i * q->padded_inputs;
+      for (int d = 0; d < l->num_inputs; d++)
+      {
+        row[d] = quantize(src[d], inv_scale, q->in_zero);
+      }
+      dst[i] = outputs[j + i]->weights;
+    }
+    kernels()->quant_gemm(q, panel, rows, dst, l->biases->weights);
+  }
+
+  _mm_free(panel);
+}
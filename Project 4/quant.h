@@ -0,0 +1,76 @@
+#ifndef QUANT_H
+#define QUANT_H
+
+#include <stdint.h>
+
+#include "layers.h"
+#include "volume.h"
+
+// Int8 execution path for the convolutional and fully-connected layers.
+//
+// Weights are quantized symmetrically per output channel to signed 8 bit:
+//   w = weight_scale[f] * qw,    qw in [-127, 127]
+// and the layer input is quantized affinely with one scale for the layer:
+//   x = in_scale * (qx - in_zero),    qx in [0, 127]
+// Activations are kept to 7 bits so that the pairwise u8 x s8 products of
+// the maddubs instructions can never saturate 16 bits. Products are accumulated in
+// int32 and converted back to real_t in the epilogue, so volumes between
+// layers stay in real_t.
+//
+// The input range of each layer comes from a calibration pass over a set of
+// images (see do_calibrate in benchmark.c) and is stored next to the layer's
+// snapshot, e.g. snapshot/layer1_conv_q8.txt.
+typedef struct quant {
+  int num_inputs;      // Weights per output channel (K)
+  int padded_inputs;   // K rounded up to a multiple of 4
+  int num_outputs;     // Output channels (F)
+  int packed_outputs;  // F rounded up to a multiple of the register tile
+
+  real_t in_scale;
+  int in_zero;
+  real_t* weight_scales;
+
+  // in_scale * weight_scales[f], and in_zero * sum(qw[f]), which together
+  // turn an int32 accumulator back into the real-valued dot product.
+  real_t* out_scales;
+  int32_t* corrections;
+
+  // Quantized weights grouped by 4 inputs: byte (k / 4, f, k % 4) holds
+  // qw[f][k], so 64 bytes cover 4 inputs of QUANT_NR output channels.
+  int8_t* packed;
+} quant_t;
+
+// Number of rows (output pixels or images) quantized into a panel at once.
+#define QUANT_MC 64
+
+// Register tile of the int8 microkernel (see kernels.h): QUANT_MR rows by
+// QUANT_NR output channels.
+#define QUANT_MR 4
+#define QUANT_NR 16
+
+// Quantizes num_filters filters (each a volume of the same size) for a layer
+// whose input was observed in the range [in_min, in_max].
+quant_t* make_quant(volume_t** filters, int num_filters, real_t in_min, real_t in_max);
+
+// Frees the quantized weights and scales.
+void free_quant(quant_t* q);
+
+// Writes the calibrated scales of a layer to a file.
+void quant_save(quant_t* q, const char* file_name);
+
+// Reads calibrated scales from a file written by quant_save and quantizes
+// filters with them. Returns NULL if the file does not exist.
+quant_t* quant_load(volume_t** filters, int num_filters, const char* file_name);
+
+// Computes rows [row, row + rows) of the int8 im2col product of a conv layer
+// (rows <= QUANT_MC, one row per output pixel across the batch starting at
+// image start) and writes the output_depth results of row i to dst[i]. panel
+// is scratch space of QUANT_MC * padded_inputs bytes, 32 byte aligned.
+void conv_rows_q8(conv_layer_t* l, volume_t** inputs, int start, int row, int rows, uint8_t* panel, real_t** dst);
+
+// Int8 versions of conv_forward and fc_forward, used when the layer has
+// quantized weights attached.
+void conv_forward_q8(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+void fc_forward_q8(fc_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+
+#endif
@@ -0,0 +1,195 @@
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+
+#include <omp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "kernels.h"
+#include "layers.h"
+#include "profile.h"
+#include "roofline.h"
+
+#define ROOFLINE_RUNS 5
+
+// Rounds of peak_fma per thread and run: some milliseconds on any variant.
+#define ROOFLINE_FMA_ITERATIONS (1L << 22)
+
+// Size of each triad array, whatever the precision.
+#define ROOFLINE_STREAM_BYTES (64L << 20)
+
+// Keeps the result of the microkernels alive.
+static volatile real_t roofline_sink;
+
+static uint64_t roofline_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double measure_peak(const kernels_t* k)
+{
+  double best = 0.0;
+  for (int run = 0; run < ROOFLINE_RUNS; run++)
+  {
+    double flops = 0.0;
+    real_t sink  = 0.0;
+    uint64_t t0  = roofline_now();
+    #pragma omp parallel reduction(+:flops, sink)
+    {
+      real_t s;
+      flops += k->peak_fma(ROOFLINE_FMA_ITERATIONS, &s);
+      sink  += s;
+    }
+    uint64_t ns = roofline_now() - t0;
+    roofline_sink = sink;
+
+    best = (flops / ns > best) ? flops / ns : best;
+  }
+  return best;
+}
+
+// a = b + s * c, counted as 3 values moved per element like STREAM does
+// (writing a also reads it into the cache first on most CPUs).
+static double measure_bandwidth()
+{
+  long n    = ROOFLINE_STREAM_BYTES / sizeof(real_t);
+  real_t* a = _mm_malloc(n * sizeof(real_t), 64);
+  real_t* b = _mm_malloc(n * sizeof(real_t), 64);
+  real_t* c = _mm_malloc(n * sizeof(real_t), 64);
+
+  // First touch by the threads that stream the same elements below.
+  #pragma omp parallel for schedule(static)
+  for (long i = 0; i < n; i++)
+  {
+    a[i] = 0.0;
+    b[i] = 1.0;
+    c[i] = 2.0;
+  }
+
+  double best = 0.0;
+  real_t s    = 3.0;
+  for (int run = 0; run < ROOFLINE_RUNS; run++)
+  {
+    uint64_t t0 = roofline_now();
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++)
+    {
+      a[i] = b[i] + s * c[i];
+    }
+    uint64_t ns = roofline_now() - t0;
+    roofline_sink = a[run];
+
+    double bytes = 3.0 * n * sizeof(real_t);
+    best = (bytes / ns > best) ? bytes / ns : best;
+  }
+
+  _mm_free(a);
+  _mm_free(b);
+  _mm_free(c);
+  return best;
+}
+
+void roofline_measure(roofline_t* r)
+{
+  const kernels_t* k = kernels();
+  r->kernels         = k->name;
+  r->threads         = omp_get_max_threads();
+  r->peak_gflops     = measure_peak(k) / r->threads;
+  r->bandwidth_gbs   = measure_bandwidth() / r->threads;
+}
+
+static void roofline_write_row(roofline_t* r, FILE* out, int json, const char* layer, const char* name,
+                               uint64_t ns, double flops, double bytes)
+{
+  double intensity  = (bytes > 0) ? flops / bytes : 0.0;
+  double gflops     = (ns > 0) ? flops / ns : 0.0;
+  double attainable = intensity * r->bandwidth_gbs;
+  int memory        = attainable < r->peak_gflops;
+  attainable        = memory ? attainable : r->peak_gflops;
+  double efficiency = (attainable > 0) ? gflops / attainable : 0.0;
+
+  if (json)
+  {
+    fprintf(out,
+            "{\"layer\": %s, \"name\": \"%s\", \"intensity\": %.3f, \"gflops\": %.3f, "
+            "\"attainable_gflops\": %.3f, \"efficiency\": %.3f, \"bound\": \"%s\"}",
+            layer, name, intensity, gflops, attainable, efficiency, memory ? "memory" : "compute");
+  }
+  else
+  {
+    fprintf(out, "%s,%s,%.3f,%.3f,%.3f,%.3f,%s\n", layer, name, intensity, gflops, attainable, efficiency,
+            memory ? "memory" : "compute");
+  }
+}
+
+void roofline_write(roofline_t* r, net_profile_t* p, FILE* out, int json)
+{
+  profile_counters_t total;
+  profile_totals(p, &total);
+  double ridge = r->peak_gflops / r->bandwidth_gbs;
+
+  if (json)
+  {
+    fprintf(out,
+            "{\n  \"kernels\": \"%s\",\n  \"threads\": %d,\n  \"peak_gflops\": %.3f,\n"
+            "  \"bandwidth_gbs\": %.3f,\n  \"ridge\": %.3f,\n  \"stages\": [",
+            r->kernels, r->threads, r->peak_gflops, r->bandwidth_gbs, ridge);
+  }
+  else
+  {
+    fprintf(out, "# %s kernels, %d threads, per thread: peak %.3f GFLOP/s, bandwidth %.3f GB/s, ridge %.3f flop/byte\n",
+            r->kernels, r->threads, r->peak_gflops, r->bandwidth_gbs, ridge);
+    fprintf(out, "layer,name,intensity,gflops,attainable_gflops,efficiency,bound\n");
+  }
+
+  uint64_t ns  = 0;
+  double flops = 0.0;
+  double bytes = 0.0;
+  int rows     = 0;
+  for (int s = 0; s < NUM_LAYERS; s++)
+  {
+    if (p->stages[s].name == NULL || total.calls[s] == 0)
+    {
+      continue;
+    }
+    double stage_flops, stage_bytes;
+    profile_work(p, &total, s, &stage_flops, &stage_bytes);
+
+    char layer[16];
+    snprintf(layer, sizeof(layer), "%d", s);
+    if (json)
+    {
+      fprintf(out, "%s\n    ", (rows > 0) ? "," : "");
+    }
+    roofline_write_row(r, out, json, layer, p->stages[s].name, total.ns[s], stage_flops, stage_bytes);
+
+    ns    += total.ns[s];
+    flops += stage_flops;
+    bytes += stage_bytes;
+    rows++;
+  }
+
+  if (json)
+  {
+    fprintf(out, "\n  ],\n  \"total\": ");
+    roofline_write_row(r, out, json, "null", "total", ns, flops, bytes);
+    fprintf(out, "\n}\n");
+  }
+  else
+  {
+    roofline_write_row(r, out, json, "", "total", ns, flops, bytes);
+  }
+}
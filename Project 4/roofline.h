@@ -0,0 +1,39 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include <stdio.h>
+
+#include "profile.h"
+
+// Roofline model of the stages of net_forward. roofline_measure times two
+// built-in microkernels on every OpenMP thread: independent vector
+// multiply-adds of the selected kernels (see kernels.h) for the peak compute
+// rate, and a STREAM triad over arrays far larger than the caches for the
+// memory bandwidth. A stage whose arithmetic intensity (flops per byte, from
+// the layer shapes in profile.h) is below the ridge point, peak over
+// bandwidth, can at best run at intensity x bandwidth: it gains from
+// blocking and narrower types, which move fewer bytes. One above it is bound
+// by the arithmetic units, and gains from vector width and fewer flops. The
+// bandwidth is that of memory, so a stage whose data stays in the caches can
+// beat its attainable rate (efficiency above 1).
+//
+// Rates are per thread, as in profile_write: the totals measured with all
+// threads busy, divided by the number of threads.
+typedef struct roofline {
+  const char* kernels;   // Variant whose peak was measured
+  int threads;
+  double peak_gflops;
+  double bandwidth_gbs;
+} roofline_t;
+
+// Measures the peak and bandwidth of this machine, best of a few runs each.
+// Takes under a second and allocates 192 MB of arrays.
+void roofline_measure(roofline_t* r);
+
+// Writes, for each stage p has counters of, its intensity, achieved and
+// attainable GFLOP/s, their ratio and whether it is memory or compute bound,
+// and a total row. CSV starts with a comment line holding the machine's
+// numbers; with json, writes a JSON object holding those and the stages.
+void roofline_write(roofline_t* r, net_profile_t* p, FILE* out, int json);
+
+#endif
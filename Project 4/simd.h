@@ -0,0 +1,188 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "volume.h"
+
+// Thin wrappers around the vector intrinsics for real_t, so the kernels in
+// kernels.c are written once for every instruction set they are compiled for
+// (see kernels.h). The widest one the compiler is allowed to use is picked:
+//
+//   AVX-512   8 double / 16 float lanes
+//   AVX2+FMA  4 double /  8 float lanes
+//   SSE4      2 double /  4 float lanes, separate multiply and add
+//   scalar    1 lane, plain C
+//
+// vload needs VLEN * sizeof(real_t) byte alignment, at most 64. vround
+// rounds to the nearest integer, and vldexp(a, n) computes a * 2^n for
+// integral n; outside AVX-512 it adds n to the exponent bits, so a * 2^n has
+// to be a normal number. AVX-512 also has masked loads and stores (vmask_t).
+#if defined(__AVX512F__)
+
+#ifdef USE_FLOAT
+typedef __m512 vreal_t;
+#define VLEN 16
+
+#define vzero()           _mm512_setzero_ps()
+#define vset1(x)          _mm512_set1_ps(x)
+#define vbroadcast(p)     _mm512_set1_ps(*(p))
+#define vload(p)          _mm512_load_ps(p)
+#define vloadu(p)         _mm512_loadu_ps(p)
+#define vstoreu(p, a)     _mm512_storeu_ps(p, a)
+#define vadd(a, b)        _mm512_add_ps(a, b)
+#define vsub(a, b)        _mm512_sub_ps(a, b)
+#define vmul(a, b)        _mm512_mul_ps(a, b)
+#define vdiv(a, b)        _mm512_div_ps(a, b)
+#define vmax(a, b)        _mm512_max_ps(a, b)
+#define vfmadd(a, b, c)   _mm512_fmadd_ps(a, b, c)
+#define vround(a)         _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT)
+#define vldexp(a, n)      _mm512_scalef_ps(a, n)
+
+typedef __mmask16 vmask_t;
+#define vmaskloadu(m, p)     _mm512_maskz_loadu_ps(m, p)
+#define vmaskstoreu(p, m, a) _mm512_mask_storeu_ps(p, m, a)
+#else
+typedef __m512d vreal_t;
+#define VLEN 8
+
+#define vzero()           _mm512_setzero_pd()
+#define vset1(x)          _mm512_set1_pd(x)
+#define vbroadcast(p)     _mm512_set1_pd(*(p))
+#define vload(p)          _mm512_load_pd(p)
+#define vloadu(p)         _mm512_loadu_pd(p)
+#define vstoreu(p, a)     _mm512_storeu_pd(p, a)
+#define vadd(a, b)        _mm512_add_pd(a, b)
+#define vsub(a, b)        _mm512_sub_pd(a, b)
+#define vmul(a, b)        _mm512_mul_pd(a, b)
+#define vdiv(a, b)        _mm512_div_pd(a, b)
+#define vmax(a, b)        _mm512_max_pd(a, b)
+#define vfmadd(a, b, c)   _mm512_fmadd_pd(a, b, c)
+#define vround(a)         _mm512_roundscale_pd(a, _MM_FROUND_TO_NEAREST_INT)
+#define vldexp(a, n)      _mm512_scalef_pd(a, n)
+
+typedef __mmask8 vmask_t;
+#define vmaskloadu(m, p)     _mm512_maskz_loadu_pd(m, p)
+#define vmaskstoreu(p, m, a) _mm512_mask_storeu_pd(p, m, a)
+#endif
+
+// Mask of the first n lanes, 0 <= n <= VLEN.
+#define vmask_first(n)    ((vmask_t)((1u << (n)) - 1))
+
+#elif defined(__AVX2__) && defined(__FMA__)
+
+#ifdef USE_FLOAT
+typedef __m256 vreal_t;
+#define VLEN 8
+
+#define vzero()           _mm256_setzero_ps()
+#define vset1(x)          _mm256_set1_ps(x)
+#define vbroadcast(p)     _mm256_broadcast_ss(p)
+#define vload(p)          _mm256_load_ps(p)
+#define vloadu(p)         _mm256_loadu_ps(p)
+#define vstoreu(p, a)     _mm256_storeu_ps(p, a)
+#define vadd(a, b)        _mm256_add_ps(a, b)
+#define vsub(a, b)        _mm256_sub_ps(a, b)
+#define vmul(a, b)        _mm256_mul_ps(a, b)
+#define vdiv(a, b)        _mm256_div_ps(a, b)
+#define vmax(a, b)        _mm256_max_ps(a, b)
+#define vfmadd(a, b, c)   _mm256_fmadd_ps(a, b, c)
+#define vround(a)         _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define vldexp(a, n) \
+  _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(a), _mm256_slli_epi32(_mm256_cvtps_epi32(n), 23)))
+#else
+typedef __m256d vreal_t;
+#define VLEN 4
+
+#define vzero()           _mm256_setzero_pd()
+#define vset1(x)          _mm256_set1_pd(x)
+#define vbroadcast(p)     _mm256_broadcast_sd(p)
+#define vload(p)          _mm256_load_pd(p)
+#define vloadu(p)         _mm256_loadu_pd(p)
+#define vstoreu(p, a)     _mm256_storeu_pd(p, a)
+#define vadd(a, b)        _mm256_add_pd(a, b)
+#define vsub(a, b)        _mm256_sub_pd(a, b)
+#define vmul(a, b)        _mm256_mul_pd(a, b)
+#define vdiv(a, b)        _mm256_div_pd(a, b)
+#define vmax(a, b)        _mm256_max_pd(a, b)
+#define vfmadd(a, b, c)   _mm256_fmadd_pd(a, b, c)
+#define vround(a)         _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define vldexp(a, n) \
+  _mm256_castsi256_pd(_mm256_add_epi64(_mm256_castpd_si256(a), _mm256_slli_epi64(VLDEXP_BITS256(n), 52)))
+// The low bits of n + 1.5 * 2^52 are the integer n in two's complement.
+#define VLDEXP_BITS256(n) _mm256_castpd_si256(_mm256_add_pd(n, _mm256_set1_pd(6755399441055744.0)))
+#endif
+
+#elif defined(__SSE4_1__)
+
+#ifdef USE_FLOAT
+typedef __m128 vreal_t;
+#define VLEN 4
+
+#define vzero()           _mm_setzero_ps()
+#define vset1(x)          _mm_set1_ps(x)
+#define vbroadcast(p)     _mm_load1_ps(p)
+#define vload(p)          _mm_load_ps(p)
+#define vloadu(p)         _mm_loadu_ps(p)
+#define vstoreu(p, a)     _mm_storeu_ps(p, a)
+#define vadd(a, b)        _mm_add_ps(a, b)
+#define vsub(a, b)        _mm_sub_ps(a, b)
+#define vmul(a, b)        _mm_mul_ps(a, b)
+#define vdiv(a, b)        _mm_div_ps(a, b)
+#define vmax(a, b)        _mm_max_ps(a, b)
+#define vfmadd(a, b, c)   _mm_add_ps(_mm_mul_ps(a, b), c)
+#define vround(a)         _mm_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define vldexp(a, n)      _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(a), _mm_slli_epi32(_mm_cvtps_epi32(n), 23)))
+#else
+typedef __m128d vreal_t;
+#define VLEN 2
+
+#define vzero()           _mm_setzero_pd()
+#define vset1(x)          _mm_set1_pd(x)
+#define vbroadcast(p)     _mm_load1_pd(p)
+#define vload(p)          _mm_load_pd(p)
+#define vloadu(p)         _mm_loadu_pd(p)
+#define vstoreu(p, a)     _mm_storeu_pd(p, a)
+#define vadd(a, b)        _mm_add_pd(a, b)
+#define vsub(a, b)        _mm_sub_pd(a, b)
+#define vmul(a, b)        _mm_mul_pd(a, b)
+#define vdiv(a, b)        _mm_div_pd(a, b)
+#define vmax(a, b)        _mm_max_pd(a, b)
+#define vfmadd(a, b, c)   _mm_add_pd(_mm_mul_pd(a, b), c)
+#define vround(a)         _mm_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define vldexp(a, n)      _mm_castsi128_pd(_mm_add_epi64(_mm_castpd_si128(a), _mm_slli_epi64(VLDEXP_BITS128(n), 52)))
+// The low bits of n + 1.5 * 2^52 are the integer n in two's complement.
+#define VLDEXP_BITS128(n) _mm_castpd_si128(_mm_add_pd(n, _mm_set1_pd(6755399441055744.0)))
+#endif
+
+#else
+
+#include <math.h>
+
+typedef real_t vreal_t;
+#define VLEN 1
+
+#define vzero()           ((real_t)0.0)
+#define vset1(x)          ((real_t)(x))
+#define vbroadcast(p)     (*(p))
+#define vload(p)          (*(p))
+#define vloadu(p)         (*(p))
+#define vstoreu(p, a)     (*(p) = (a))
+#define vadd(a, b)        ((a) + (b))
+#define vsub(a, b)        ((a) - (b))
+#define vmul(a, b)        ((a) * (b))
+#define vdiv(a, b)        ((a) / (b))
+#define vmax(a, b)        (((a) > (b)) ? (a) : (b))
+#define vfmadd(a, b, c)   ((a) * (b) + (c))
+#define vround(a)         ((real_t)rint(a))
+#define vldexp(a, n)      ((real_t)ldexp(a, (int)(n)))
+
+#endif
+
+#endif
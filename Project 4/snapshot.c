@@ -0,0 +1,293 @@
+// mmap, fstat
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "layers.h"
+#include "network.h"
+#include "snapshot.h"
+#include "volume.h"
+
+// Upper bound on the arrays of a network: 4 per conv layer, 3 for the fc.
+#define SNAPSHOT_MAX_ARRAYS 16
+
+static conv_layer_t* snapshot_conv(network_t* net, int layer)
+{
+  return (layer == 0) ? net->l0 : ((layer == 3) ? net->l3 : net->l6);
+}
+
+static size_t snapshot_elems(const snapshot_array_t* a)
+{
+  return (size_t)a->width * a->height * a->depth * a->count;
+}
+
+// Lists the arrays of the network in file order, together with their offsets,
+// and returns their number. The table a file is mapped with has to be exactly
+// the one the network expects.
+static int snapshot_layout(network_t* net, snapshot_array_t* arrays, uint64_t* size)
+{
+  static const int conv_layers[3] = {0, 3, 6};
+
+  memset(arrays, 0, sizeof(snapshot_array_t) * SNAPSHOT_MAX_ARRAYS);
+  int n = 0;
+  for (int i = 0; i < 3; i++)
+  {
+    conv_layer_t* l = snapshot_conv(net, conv_layers[i]);
+    arrays[n++] = (snapshot_array_t){conv_layers[i], SNAPSHOT_FILTERS, l->filter_width, l->filter_height,
+                                     l->input_depth, l->output_depth, 0};
+    arrays[n++] = (snapshot_array_t){conv_layers[i], SNAPSHOT_BIASES, 1, 1, l->output_depth, 1, 0};
+    arrays[n++] = (snapshot_array_t){conv_layers[i], SNAPSHOT_PACKED, GEMM_NR, l->num_weights, 1,
+                                     l->packed_depth / GEMM_NR, 0};
+    if (l->winograd != NULL)
+    {
+      arrays[n++] = (snapshot_array_t){conv_layers[i], SNAPSHOT_WINOGRAD, l->packed_depth, l->input_depth, 1, 36, 0};
+    }
+  }
+  arrays[n++] = (snapshot_array_t){9, SNAPSHOT_FILTERS, 1, 1, net->l9->num_inputs, net->l9->output_depth, 0};
+  arrays[n++] = (snapshot_array_t){9, SNAPSHOT_BIASES, 1, 1, net->l9->output_depth, 1, 0};
+  arrays[n++] = (snapshot_array_t){9, SNAPSHOT_PACKED, net->l9->num_inputs, net->l9->output_depth, 1, 1, 0};
+
+  uint64_t offset = sizeof(snapshot_header_t) + n * sizeof(snapshot_array_t);
+  for (int i = 0; i < n; i++)
+  {
+    offset = (offset + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN * SNAPSHOT_ALIGN;
+    arrays[i].offset = offset;
+    offset += snapshot_elems(&arrays[i]) * sizeof(real_t);
+  }
+  *size = offset;
+
+  return n;
+}
+
+// FNV-1a, 64 bit.
+static uint64_t snapshot_checksum(const uint8_t* data, size_t len)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static volume_t** snapshot_filters(network_t* net, int layer)
+{
+  return (layer == 9) ? net->l9->filters : snapshot_conv(net, layer)->filters;
+}
+
+static volume_t* snapshot_biases(network_t* net, int layer)
+{
+  return (layer == 9) ? net->l9->biases : snapshot_conv(net, layer)->biases;
+}
+
+static real_t** snapshot_packed(network_t* net, int layer)
+{
+  return (layer == 9) ? &net->l9->packed : &snapshot_conv(net, layer)->packed;
+}
+
+// Copies array a of the network to dst.
+static void snapshot_read(network_t* net, const snapshot_array_t* a, real_t* dst)
+{
+  size_t len = snapshot_elems(a);
+
+  switch (a->kind)
+  {
+  case SNAPSHOT_FILTERS:
+  {
+    size_t k_len = len / a->count;
+    for (uint32_t f = 0; f < a->count; f++)
+    {
+      memcpy(dst + f * k_len, snapshot_filters(net, a->layer)[f]->weights, sizeof(real_t) * k_len);
+    }
+    break;
+  }
+  case SNAPSHOT_BIASES:
+    memcpy(dst, snapshot_biases(net, a->layer)->weights, sizeof(real_t) * len);
+    break;
+  case SNAPSHOT_PACKED:
+    memcpy(dst, *snapshot_packed(net, a->layer), sizeof(real_t) * len);
+    break;
+  case SNAPSHOT_WINOGRAD:
+    memcpy(dst, snapshot_conv(net, a->layer)->winograd, sizeof(real_t) * len);
+    break;
+  }
+}
+
+// Replaces the weights array a of the network with a view of src, freeing
+// the weights it owned. With src NULL, only drops the views.
+static void snapshot_point(network_t* net, const snapshot_array_t* a, real_t* src)
+{
+  switch (a->kind)
+  {
+  case SNAPSHOT_FILTERS:
+  {
+    size_t k_len = snapshot_elems(a) / a->count;
+    volume_t** filters = snapshot_filters(net, a->layer);
+    for (uint32_t f = 0; f < a->count; f++)
+    {
+      if (src != NULL)
+      {
+        free(filters[f]->weights);
+      }
+      filters[f]->weights = (src != NULL) ? src + f * k_len : NULL;
+    }
+    break;
+  }
+  case SNAPSHOT_BIASES:
+  {
+    volume_t* biases = snapshot_biases(net, a->layer);
+    if (src != NULL)
+    {
+      free(biases->weights);
+    }
+    biases->weights = src;
+    break;
+  }
+  case SNAPSHOT_PACKED:
+  {
+    real_t** packed = snapshot_packed(net, a->layer);
+    if (src != NULL)
+    {
+      _mm_free(*packed);
+    }
+    *packed = src;
+    break;
+  }
+  case SNAPSHOT_WINOGRAD:
+  {
+    conv_layer_t* l = snapshot_conv(net, a->layer);
+    if (src != NULL)
+    {
+      _mm_free(l->winograd);
+    }
+    l->winograd = src;
+    break;
+  }
+  }
+}
+
+int snapshot_save(network_t* net, const char* file_name)
+{
+  snapshot_array_t arrays[SNAPSHOT_MAX_ARRAYS];
+  uint64_t size;
+  int n = snapshot_layout(net, arrays, &size);
+
+  uint8_t* image = calloc(size, 1);
+  snapshot_header_t* header = (snapshot_header_t*)image;
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header->version    = SNAPSHOT_VERSION;
+  header->real_size  = sizeof(real_t);
+  header->gemm_nr    = GEMM_NR;
+  header->num_arrays = n;
+  header->size       = size;
+
+  memcpy(image + sizeof(snapshot_header_t), arrays, n * sizeof(snapshot_array_t));
+  for (int i = 0; i < n; i++)
+  {
+    snapshot_read(net, &arrays[i], (real_t*)(image + arrays[i].offset));
+  }
+  header->checksum = snapshot_checksum(image + sizeof(snapshot_header_t), size - sizeof(snapshot_header_t));
+
+  FILE* fout = fopen(file_name, "wb");
+  int ok = (fout != NULL) && fwrite(image, 1, size, fout) == size;
+  if (fout != NULL)
+  {
+    ok = (fclose(fout) == 0) && ok;
+  }
+  free(image);
+
+  return ok;
+}
+
+int snapshot_map(network_t* net, const char* file_name)
+{
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0)
+  {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header_t))
+  {
+    fprintf(stderr, "%s: not a snapshot, ignoring it\n", file_name);
+    close(fd);
+    return 0;
+  }
+
+  uint8_t* image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: cannot map the snapshot, ignoring it\n", file_name);
+    return 0;
+  }
+
+  snapshot_array_t arrays[SNAPSHOT_MAX_ARRAYS];
+  uint64_t size;
+  int n = snapshot_layout(net, arrays, &size);
+
+  const snapshot_header_t* header = (const snapshot_header_t*)image;
+  const char* error = NULL;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 || header->version != SNAPSHOT_VERSION)
+  {
+    error = "not a snapshot of this version";
+  }
+  else if (header->real_size != sizeof(real_t) || header->gemm_nr != GEMM_NR)
+  {
+    error = "written by a build with a different precision";
+  }
+  else if (header->size != (uint64_t)st.st_size || header->num_arrays != (uint32_t)n || header->size != size ||
+           memcmp(image + sizeof(snapshot_header_t), arrays, n * sizeof(snapshot_array_t)) != 0)
+  {
+    error = "does not match the network";
+  }
+  else if (header->checksum != snapshot_checksum(image + sizeof(snapshot_header_t), size - sizeof(snapshot_header_t)))
+  {
+    error = "checksum mismatch";
+  }
+  if (error != NULL)
+  {
+    fprintf(stderr, "%s: %s, ignoring it\n", file_name, error);
+    munmap(image, st.st_size);
+    return 0;
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    snapshot_point(net, &arrays[i], (real_t*)(image + arrays[i].offset));
+  }
+  net->snapshot      = image;
+  net->snapshot_size = size;
+
+  return 1;
+}
+
+void snapshot_unmap(network_t* net)
+{
+  snapshot_array_t arrays[SNAPSHOT_MAX_ARRAYS];
+  uint64_t size;
+  int n = snapshot_layout(net, arrays, &size);
+
+  for (int i = 0; i < n; i++)
+  {
+    snapshot_point(net, &arrays[i], NULL);
+  }
+  munmap(net->snapshot, net->snapshot_size);
+  net->snapshot      = NULL;
+  net->snapshot_size = 0;
+}
@@ -0,0 +1,71 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "network.h"
+
+// Binary snapshot of the network weights, the counterpart of the text files
+// in snapshot/ that conv_load and fc_load parse. It is written by
+// "./benchmark convert" and mapped read-only by load_cnn_snapshot, so startup
+// does not parse any text and every process running the network shares the
+// same page cache pages for the weights.
+//
+// Layout: a snapshot_header, then num_arrays snapshot_array entries, then the
+// arrays themselves, each starting on a SNAPSHOT_ALIGN byte boundary. Besides
+// the raw filters and biases of every layer, the file holds the packed GEMM
+// filters of the conv and fc layers and the Winograd transformed filters of
+// the conv layers, so those are mapped as well instead of being recomputed.
+// Both depend on real_t and on the GEMM register tile, which the header
+// records; a file written by a build with a different real_t or tile is
+// rejected.
+
+#define SNAPSHOT_MAGIC "CNNSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGN 64
+
+typedef struct snapshot_header {
+  char magic[8];        // SNAPSHOT_MAGIC, NUL terminated
+  uint32_t version;     // SNAPSHOT_VERSION
+  uint32_t real_size;   // sizeof(real_t) of the weights
+  uint32_t gemm_nr;     // GEMM_NR the packed filters are blocked by
+  uint32_t num_arrays;
+  uint64_t size;        // Size of the whole file in bytes
+  uint64_t checksum;    // FNV-1a of everything after the header
+  uint8_t reserved[24];
+} snapshot_header_t;
+
+// Kinds of arrays in a snapshot.
+typedef enum snapshot_kind {
+  SNAPSHOT_FILTERS,   // count filters of width x height x depth, back to back
+  SNAPSHOT_BIASES,    // 1 x 1 x output_depth
+  SNAPSHOT_PACKED,    // conv_layer_t/fc_layer_t.packed: count blocks of height x width
+  SNAPSHOT_WINOGRAD,  // conv_layer_t.winograd: count matrices of height x width
+} snapshot_kind_t;
+
+typedef struct snapshot_array {
+  uint32_t layer;     // Index of the layer in the network (l0 -> 0, l9 -> 9)
+  uint32_t kind;      // snapshot_kind_t
+  uint32_t width;
+  uint32_t height;
+  uint32_t depth;
+  uint32_t count;
+  uint64_t offset;    // From the start of the file, a multiple of SNAPSHOT_ALIGN
+} snapshot_array_t;
+
+// Writes the weights of a loaded network to a binary snapshot. Returns 1 on
+// success and 0 if the file could not be written.
+int snapshot_save(network_t* net, const char* file_name);
+
+// Maps a binary snapshot and points the weights of the network into it. The
+// filters, biases, packed and Winograd weights of the network become read-only
+// views of the mapping, which free_network releases. Returns 0, leaving the
+// network untouched, if the file does not exist or does not match the build
+// or the network.
+int snapshot_map(network_t* net, const char* file_name);
+
+// Unmaps the snapshot of a network mapped by snapshot_map. The views of the
+// mapping are set to NULL, the volumes holding them stay allocated.
+void snapshot_unmap(network_t* net);
+
+#endif
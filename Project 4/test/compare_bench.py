@@ -0,0 +1,70 @@
+import math
+import sys
+
+# Two-sided significance level of the comparison.
+ALPHA = 0.05
+
+if len(sys.argv) < 3:
+    print("Usage: python compare_bench.py <file> <reference>")
+    sys.exit(2)
+
+
+def read_latencies(path):
+    latencies = []
+    with open(path, "r") as fin:
+        for line in fin:
+            if line.startswith("LATENCY"):
+                latencies.append(float(line.split(",")[1]))
+    if len(latencies) < 2:
+        print("ERROR: Fewer than 2 LATENCY lines in {}".format(path))
+        sys.exit(2)
+    return latencies
+
+
+def median(values):
+    s = sorted(values)
+    n = len(s)
+    return s[n // 2] if n % 2 else (s[n // 2 - 1] + s[n // 2]) / 2
+
+
+# Mann-Whitney U test with the normal approximation, corrected for ties.
+# Returns U of a and the two-sided p-value of the two samples coming from
+# the same distribution.
+def mann_whitney(a, b):
+    values = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+    n = len(values)
+    ranks = [0.0] * n
+    ties = 0.0
+    i = 0
+    while i < n:
+        j = i
+        while j + 1 < n and values[j + 1][0] == values[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        t = j - i + 1
+        ties += t ** 3 - t
+        i = j + 1
+
+    n1, n2 = len(a), len(b)
+    r1 = sum(ranks[k] for k in range(n) if values[k][1] == 0)
+    u = r1 - n1 * (n1 + 1) / 2
+    mean = n1 * n2 / 2
+    var = n1 * n2 / 12 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return u, 1.0
+    z = (abs(u - mean) - 0.5) / math.sqrt(var)
+    return u, math.erfc(max(z, 0) / math.sqrt(2))
+
+
+lat = read_latencies(sys.argv[1])
+ref = read_latencies(sys.argv[2])
+
+speedup = median(ref) / median(lat)
+u, p = mann_whitney(lat, ref)
+
+print("median latency: {:.1f} us ({} runs), reference {:.1f} us ({} runs)"
+      .format(median(lat), len(lat), median(ref), len(ref)))
+print("speedup: {:.2f}x".format(speedup))
+print("Mann-Whitney U = {:.1f}, p = {:.3g}: {}"
+      .format(u, p, "significant" if p < ALPHA else "not significant"))
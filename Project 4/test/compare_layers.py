@@ -4,9 +4,12 @@ import sys
 NUM_LAYERS = 12
 
 if len(sys.argv) < 3:
-    print("Usage: python compare_layers.py <file> <reference>")
+    print("Usage: python compare_layers.py <file> <reference> [tolerance]")
     sys.exit(2)
 
+# Absolute tolerance per value; single precision builds need a looser one.
+TOLERANCE = float(sys.argv[3]) if len(sys.argv) > 3 else 1e-10
+
 with open(sys.argv[1], "r") as fin:
     layer_data = fin.readlines()
 
@@ -30,7 +33,7 @@ for i in range(NUM_LAYERS):
         sys.exit(2)
 
     for j in range(1, len(invals)):
-        if not(math.isclose(float(invals[j]), float(refvals[j]), abs_tol=1e-10)):
+        if not(math.isclose(float(invals[j]), float(refvals[j]), abs_tol=TOLERANCE)):
             print("ERROR: Value {} at layer {} is wrong: {} (should be {})"
                 .format(j, i, float(invals[j]), float(refvals[j])))
             sys.exit(1)
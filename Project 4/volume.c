@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 // Include SSE intrinsics
 #if defined(_MSC_VER)
@@ -15,26 +16,25 @@
 
 #include "volume.h"
 
-inline double volume_get(volume_t* v, int x, int y, int d)
+inline real_t volume_get(volume_t* v, int x, int y, int d)
 {
-  int temp = ((v->width * y) + x) * v->depth + d;
-  return v->weights[temp];
+  return v->weights[volume_offset(v, x, y, d)];
 }
 
-inline void volume_set(volume_t* v, int x, int y, int d, double value)
+inline void volume_set(volume_t* v, int x, int y, int d, real_t value)
 {
-  int temp = ((v->width * y) + x) * v->depth + d;
-  v->weights[temp] = value;
+  v->weights[volume_offset(v, x, y, d)] = value;
 }
 
-volume_t* make_volume(int width, int height, int depth, double value)
+volume_t* make_volume(int width, int height, int depth, real_t value)
 {
   volume_t* new_vol = malloc(sizeof(struct volume));
-  new_vol->weights = malloc(sizeof(double) * width * height * depth);
+  new_vol->weights = malloc(sizeof(real_t) * width * height * depth);
 
   new_vol->width  = width;
   new_vol->height = height;
   new_vol->depth  = depth;
+  new_vol->pad    = 0;
 
   for (int y = 0; y < height; y++)
   {
@@ -51,29 +51,56 @@ volume_t* make_volume(int width, int height, int depth, double value)
   return new_vol;
 }
 
+volume_t* make_padded_volume(int width, int height, int depth, int pad)
+{
+  volume_t* new_vol = malloc(sizeof(struct volume));
+  int row = (width + 2 * pad) * depth;
+  real_t* base = calloc((size_t)row * (height + 2 * pad), sizeof(real_t));
+
+  new_vol->width   = width;
+  new_vol->height  = height;
+  new_vol->depth   = depth;
+  new_vol->pad     = pad;
+  new_vol->weights = base + pad * row + pad * depth;
+
+  return new_vol;
+}
+
+void volume_clear_halo(volume_t* v)
+{
+  if (v->pad == 0)
+  {
+    return;
+  }
+
+  int row = volume_offset(v, 0, 1, 0);
+  int side = v->pad * v->depth;
+  // Rows above and below the interior, then the cells left and right of it
+  memset(&v->weights[volume_offset(v, -v->pad, -v->pad, 0)], 0, sizeof(real_t) * row * v->pad);
+  memset(&v->weights[volume_offset(v, -v->pad, v->height, 0)], 0, sizeof(real_t) * row * v->pad);
+  for (int y = 0; y < v->height; y++)
+  {
+    memset(&v->weights[volume_offset(v, -v->pad, y, 0)], 0, sizeof(real_t) * side);
+    memset(&v->weights[volume_offset(v, v->width, y, 0)], 0, sizeof(real_t) * side);
+  }
+}
+
 void copy_volume(volume_t* dest, volume_t* src)
 {
   assert(dest->width == src->width);
   assert(dest->height == src->height);
   assert(dest->depth == src->depth);
 
-
-    for (int x = 0; x < dest->width; x++)
-    {
-      for (int y = 0; y < dest->height; y++)
-      {
-        for (int d = 0; d < dest->depth; d++)
-        {
-          dest->weights[((dest->width * y) + x) * dest->depth + d] = src->weights[((src->width * y) + x) * src->depth + d];
-          //volume_set(dest, x, y, d, volume_get(src, x, y, d));
-        }
-      }
-    }
-
+  // Rows are contiguous in both volumes, whatever their halos.
+  for (int y = 0; y < dest->height; y++)
+  {
+    memcpy(&dest->weights[volume_offset(dest, 0, y, 0)], &src->weights[volume_offset(src, 0, y, 0)],
+           sizeof(real_t) * dest->width * dest->depth);
+  }
 }
 
 void free_volume(volume_t* v)
 {
-  free(v->weights);
+  free(v->weights + volume_offset(v, -v->pad, -v->pad, 0));
   free(v);
 }
@@ -4,6 +4,15 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+// Element type of every volume and layer weight. The project is built in
+// double precision by default; building with -DUSE_FLOAT (make
+// PRECISION=float) runs the whole network in single precision instead.
+#ifdef USE_FLOAT
+typedef float real_t;
+#else
+typedef double real_t;
+#endif
+
 // Volumes are used to represent the activations (i.e., state) between the
 // different layers of the CNN. They all have three dimensions. The inter-
 // pretation of their content depends on the layer that produced them. Before
@@ -14,25 +23,46 @@
 //
 // The weights are represented as a 1-d array with length
 // width * height * depth.
+//
+// A volume can also carry a halo of pad zeroed cells on each side, so that
+// a convolution with padding pad can read the padded input without bounds
+// checks. weights then points at cell (0, 0) of the interior and consecutive
+// rows are (width + 2 * pad) cells apart; the halo is at negative offsets and
+// at the end of each row.
 typedef struct volume
 {
   int width;
   int height;
   int depth;
-  double* weights;
+  int pad;
+  real_t* weights;
 } volume_t;
 
+// Offset of the element at (x, y, d) from v->weights. x and y may range over
+// [-pad, width + pad) and [-pad, height + pad) to address the halo.
+static inline int volume_offset(const volume_t* v, int x, int y, int d)
+{
+  return ((v->width + 2 * v->pad) * y + x) * v->depth + d;
+}
+
 // Gets the element in the volume at the coordinates (x, y, d).
-double volume_get(volume_t* v, int x, int y, int d);
+real_t volume_get(volume_t* v, int x, int y, int d);
 
 // Sets the element in the volume at the coordinates (x, y, d) to value
-void volume_set(volume_t* v, int x, int y, int d, double value);
+void volume_set(volume_t* v, int x, int y, int d, real_t value);
 
 // Allocates a new volume with the specified dimensions, initializes it to the
 // specified value.
-volume_t* make_volume(int width, int height, int depth, double value);
+volume_t* make_volume(int width, int height, int depth, real_t value);
+
+// Allocates a new zeroed volume with a halo of pad cells around it.
+volume_t* make_padded_volume(int width, int height, int depth, int pad);
+
+// Sets the halo of a padded volume to zero.
+void volume_clear_halo(volume_t* v);
 
-// Copies the contents of one volume into another.
+// Copies the contents of one volume into another. The halos are left alone,
+// so the volumes may have different padding.
 void copy_volume(volume_t* dest, volume_t* src);
 
 // Frees the weights array and the struct itself.
@@ -0,0 +1,245 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Include SSE intrinsics
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#include <x86intrin.h>
+#endif
+
+#include "kernels.h"
+#include "layers.h"
+#include "winograd.h"
+#include "volume.h"
+
+// Number of tiles (across the whole batch) transformed and multiplied at
+// once. Must be a multiple of GEMM_MR.
+#define WINO_TILES 16
+
+// Filter transform for the interpolation points 0, 1, -1, 2, -2 and infinity.
+// The matching data and output transforms are spelled out in winograd_bt and
+// winograd_at in kernels.c:
+//
+//   B^T = [ 4  0 -5  0  1  0 ]      A^T = [ 1  1  1  1  1  0 ]
+//         [ 0 -4 -4  1  1  0 ]            [ 0  1 -1  2 -2  1 ]
+//         [ 0  4 -4 -1  1  0 ]
+//         [ 0 -2 -1  2  1  0 ]
+//         [ 0  2 -1 -2  1  0 ]
+//         [ 0  4  0 -5  0  1 ]
+static const double G[WINO_A][WINO_R] = {
+  {  1.0 / 4,        0.0,       0.0,        0.0,       0.0 },
+  { -1.0 / 6,  -1.0 / 6,  -1.0 / 6,  -1.0 / 6,  -1.0 / 6 },
+  { -1.0 / 6,   1.0 / 6,  -1.0 / 6,   1.0 / 6,  -1.0 / 6 },
+  {  1.0 / 24,  1.0 / 12,  1.0 / 6,   1.0 / 3,   2.0 / 3 },
+  {  1.0 / 24, -1.0 / 12,  1.0 / 6,  -1.0 / 3,   2.0 / 3 },
+  {       0.0,       0.0,       0.0,        0.0,       1.0 },
+};
+
+int winograd_supported(conv_layer_t* l)
+{
+  return l->filter_width == WINO_R && l->filter_height == WINO_R && l->stride == 1;
+}
+
+// The transformed filters are stored as 36 matrices, one per element (a, b)
+// of the 6x6 tile, each an input_depth x packed_depth matrix.
+void winograd_transform_filters(conv_layer_t* l)
+{
+  int depth = l->input_depth;
+  int ldb = l->packed_depth;
+
+  for (int f = 0; f < l->output_depth; f++)
+  {
+    volume_t* filter = l->filters[f];
+    for (int d = 0; d < depth; d++)
+    {
+      // tmp = G g, then U = tmp G^T
+      double tmp[WINO_A][WINO_R];
+      for (int a = 0; a < WINO_A; a++)
+      {
+        for (int x = 0; x < WINO_R; x++)
+        {
+          double sum = 0.0;
+          for (int y = 0; y < WINO_R; y++)
+          {
+            sum += G[a][y] * filter->weights[((filter->width * y) + x) * depth + d];
+          }
+          tmp[a][x] = sum;
+        }
+      }
+      for (int a = 0; a < WINO_A; a++)
+      {
+        for (int b = 0; b < WINO_A; b++)
+        {
+          double sum = 0.0;
+          for (int x = 0; x < WINO_R; x++)
+          {
+            sum += tmp[a][x] * G[b][x];
+          }
+          l->winograd[((a * WINO_A + b) * depth + d) * ldb + f] = sum;
+        }
+      }
+    }
+  }
+}
+
+// Copies the 6x6 input tile at (x0, y0) into tile, with zeros outside the
+// input.
+static void winograd_gather(volume_t* in, int x0, int y0, int depth, real_t* tile)
+{
+  for (int ty = 0; ty < WINO_A; ty++)
+  {
+    int in_y = y0 + ty;
+    for (int tx = 0; tx < WINO_A; tx++)
+    {
+      int in_x = x0 + tx;
+      real_t* dst = tile + (ty * WINO_A + tx) * depth;
+      if (in_y >= 0 && in_y < in->height && in_x >= 0 && in_x < in->width)
+      {
+        memcpy(dst, &in->weights[volume_offset(in, in_x, in_y, 0)], sizeof(real_t) * depth);
+      }
+      else
+      {
+        memset(dst, 0, sizeof(real_t) * depth);
+      }
+    }
+  }
+}
+
+int winograd_pool_supported(pool_layer_t* p)
+{
+  return p->pool_width == WINO_M && p->pool_height == WINO_M && p->stride == WINO_M && p->pad == 0;
+}
+
+// Runs the convolution on the batch. With pooled set, every complete 2x2 tile
+// is reduced to relu(max(tile)) and written to pixel (oy / 2, ox / 2) of the
+// outputs instead.
+static void winograd_forward(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end, int pooled)
+{
+  assert(winograd_supported(l));
+
+  int depth = l->input_depth;
+  int ldb = l->packed_depth;
+  int tiles_x = (l->output_width + WINO_M - 1) / WINO_M;
+  int tiles_y = (l->output_height + WINO_M - 1) / WINO_M;
+  int tiles = tiles_x * tiles_y;
+  int total = tiles * (end - start + 1);
+
+  // tile: one gathered 6x6 input tile, tmp: B^T applied to its columns,
+  // v: B^T d B of a block of tiles as 36 matrices of WINO_TILES x depth,
+  // m: the 36 products with the filters, each WINO_TILES x ldb,
+  // at / y: A^T M and A^T M A of one tile.
+  const kernels_t* kernel = kernels();
+  real_t* tile = _mm_malloc(sizeof(real_t) * WINO_A * WINO_A * depth, 32);
+  real_t* tmp  = _mm_malloc(sizeof(real_t) * WINO_A * WINO_A * depth, 32);
+  real_t* v    = _mm_malloc(sizeof(real_t) * WINO_A * WINO_A * WINO_TILES * depth, 32);
+  real_t* m    = _mm_malloc(sizeof(real_t) * WINO_A * WINO_A * WINO_TILES * ldb, 32);
+  real_t* at   = _mm_malloc(sizeof(real_t) * WINO_M * WINO_A * ldb, 32);
+  real_t* y    = _mm_malloc(sizeof(real_t) * WINO_M * WINO_M * ldb, 32);
+
+  for (int t0 = 0; t0 < total; t0 += WINO_TILES)
+  {
+    int rows = (total - t0 < WINO_TILES) ? total - t0 : WINO_TILES;
+
+    // Input transform
+    for (int t = 0; t < WINO_TILES; t++)
+    {
+      if (t >= rows)
+      {
+        for (int e = 0; e < WINO_A * WINO_A; e++)
+        {
+          memset(v + (e * WINO_TILES + t) * depth, 0, sizeof(real_t) * depth);
+        }
+        continue;
+      }
+
+      volume_t* in = inputs[start + (t0 + t) / tiles];
+      int n = (t0 + t) % tiles;
+      int y0 = (n / tiles_x) * WINO_M - l->pad;
+      int x0 = (n % tiles_x) * WINO_M - l->pad;
+
+      // B^T is applied to the tile's columns straight from the input when its
+      // halo covers the whole tile; only tiles reaching past it are gathered.
+      const real_t* src = tile;
+      int src_stride = WINO_A * depth;
+      if (x0 >= -in->pad && x0 + WINO_A <= in->width + in->pad && y0 >= -in->pad &&
+          y0 + WINO_A <= in->height + in->pad)
+      {
+        src = &in->weights[volume_offset(in, x0, y0, 0)];
+        src_stride = volume_offset(in, 0, 1, 0);
+      }
+      else
+      {
+        winograd_gather(in, x0, y0, depth, tile);
+      }
+
+      kernel->winograd_input(src, src_stride, depth, tmp, v + t * depth, WINO_TILES * depth);
+    }
+
+    // One matrix product per tile element
+    kernel->winograd_gemm(l, v, WINO_TILES, m);
+
+    // Output transform
+    for (int t = 0; t < rows; t++)
+    {
+      volume_t* out = outputs[start + (t0 + t) / tiles];
+      int n = (t0 + t) % tiles;
+      int oy = (n / tiles_x) * WINO_M;
+      int ox = (n % tiles_x) * WINO_M;
+
+      kernel->winograd_output(m + t * ldb, WINO_TILES * ldb, ldb, l->output_depth, at, y);
+
+      if (pooled)
+      {
+        if (oy + WINO_M > l->output_height || ox + WINO_M > l->output_width)
+        {
+          continue;
+        }
+        real_t* dst = &out->weights[volume_offset(out, ox / WINO_M, oy / WINO_M, 0)];
+        for (int f = 0; f < l->output_depth; f++)
+        {
+          real_t max = y[f];
+          for (int k = 1; k < WINO_M * WINO_M; k++)
+          {
+            max = (y[k * ldb + f] > max) ? y[k * ldb + f] : max;
+          }
+          max += l->biases->weights[f];
+          dst[f] = (max < 0.0) ? 0.0 : max;
+        }
+        continue;
+      }
+
+      for (int i = 0; i < WINO_M && oy + i < out->height; i++)
+      {
+        for (int j = 0; j < WINO_M && ox + j < out->width; j++)
+        {
+          real_t* src = y + (i * WINO_M + j) * ldb;
+          real_t* dst = &out->weights[volume_offset(out, ox + j, oy + i, 0)];
+          for (int f = 0; f < l->output_depth; f++)
+          {
+            dst[f] = src[f] + l->biases->weights[f];
+          }
+        }
+      }
+    }
+  }
+
+  _mm_free(tile);
+  _mm_free(tmp);
+  _mm_free(v);
+  _mm_free(m);
+  _mm_free(at);
+  _mm_free(y);
+}
+
+void conv_forward_winograd(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  winograd_forward(l, inputs, outputs, start, end, 0);
+}
+
+void conv_relu_pool_forward_winograd(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end)
+{
+  winograd_forward(l, inputs, outputs, start, end, 1);
+}
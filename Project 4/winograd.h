@@ -0,0 +1,44 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+
+#include "layers.h"
+#include "volume.h"
+
+// Winograd F(2x2, 5x5) convolution for 5x5 filters with stride 1.
+//
+// Each 2x2 block of output pixels is computed from the 6x6 block of input
+// pixels it depends on as
+//
+//   Y = A^T [ (G g G^T) .* (B^T d B) ] A
+//
+// where g is the 5x5 filter, d the 6x6 input tile and .* the elementwise
+// product. The filter transform G g G^T is done once at conv_load time, which
+// leaves 36 multiplications per input channel and filter for 4 outputs instead
+// of the 100 of direct convolution. Summed over the input channels, each of
+// the 36 elementwise products becomes a (tiles x input_depth) by
+// (input_depth x filters) matrix product, which runs on the same GEMM
+// microkernel as the im2col path.
+
+// Output tile, filter and input tile sizes of F(2x2, 5x5).
+#define WINO_M 2
+#define WINO_R 5
+#define WINO_A (WINO_M + WINO_R - 1)
+
+// Returns whether the Winograd kernel can run the layer.
+int winograd_supported(conv_layer_t* l);
+
+// Computes l->winograd from l->filters.
+void winograd_transform_filters(conv_layer_t* l);
+
+// Winograd version of conv_forward, used when l->algo is CONV_ALGO_WINOGRAD.
+void conv_forward_winograd(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+
+// Returns whether the pool's windows are exactly the 2x2 output tiles, in which
+// case conv_relu_pool_forward_winograd can pool each tile as it is produced.
+int winograd_pool_supported(pool_layer_t* p);
+
+// Winograd version of conv_relu_pool_forward: writes relu(max(tile)) of every
+// 2x2 output tile to the pooled outputs.
+void conv_relu_pool_forward_winograd(conv_layer_t* l, volume_t** inputs, volume_t** outputs, int start, int end);
+
+#endif